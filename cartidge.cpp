@@ -1,148 +1,258 @@
 
 /**************************************
- * Battery-backed RAM
+ * Cartridge mappers
+ *
+ * The cartridge registers live at odd addresses in 0xA130F1-0xA130FF
+ * (CART_REGS[0] is 0xA130F1, CART_REGS[7] is 0xA130FF). A mapper decodes
+ * some of them and rebuilds the 68000 memory map from their contents
+ * whenever they change: the banked ROM and the backup RAM are then plain
+ * pages, and the accesses never go through a handler.
  **************************************/
 
-uint8_t *backup_ram_shadow;
-bool backup_ram_present;
-bool backup_ram_enabled;
-uint8_t BACKUP_RAM[0x10000];
+struct cart_mapper
+{
+    const char *name;
+    uint8_t regs;               // registers decoded by the mapper (bitmask)
+    void (*remap)(void);        // map the ROM pages (0x00-0x3F)
+};
+
+MACHINE_LOCAL uint8_t CART_REGS[8];
+static MACHINE_LOCAL const cart_mapper *MAPPER;
+static MACHINE_LOCAL int ROM_PAGES;             // ROM size in 64KB pages
 
-void backup_ram_switch_w8(unsigned int address, unsigned int value)
+// Map 8 pages (512KB) at base from the specified bank of the ROM
+static void map_rom_bank(int base, int bank)
 {
-    if (address == 0xA130F1)
+    for (int i=0;i<8;++i)
     {
-        backup_ram_enabled = BIT(value, 0);
-        return;
+        int page = bank*8 + i;
+        if (page < ROM_PAGES)
+            mem_map_rom(base+i, ROM + page*65536);
+        else
+            mem_map_io(base+i, &UNMAPPED);
     }
+}
+
+/**************************************
+ * Battery-backed RAM
+ *
+ * Mapped over the ROM page selected by the header (or the database),
+ * while bit 0 of 0xA130F1 is set. It can be kept in a file (see
+ * mem_sram_open), which is mapped in memory: after every flush, the
+ * first write goes through a handler that marks it dirty and maps the
+ * page as plain RAM again, so that only frames which modified it
+ * are flushed.
+ **************************************/
+
+MACHINE_LOCAL bool backup_ram_present;
+MACHINE_LOCAL bool backup_ram_dirty;
+MACHINE_LOCAL uint8_t *BACKUP_RAM;
+static MACHINE_LOCAL uint8_t *backup_ram_mem;  // when not in a file (see mem_alloc)
+static MACHINE_LOCAL bool backup_ram_mapped;    // BACKUP_RAM is a file mapping
+static MACHINE_LOCAL int backup_ram_page;
 
-    io_mem_w8(address, value);
+static void backup_ram_remap(void);
+
+static void backup_ram_w8(unsigned int address, unsigned int value)
+{
+    backup_ram_dirty = true;
+    backup_ram_remap();
+    BACKUP_RAM[address & 0xFFFF] = value;
 }
 
-unsigned int backup_ram_r8(unsigned int address)
+static void backup_ram_w16(unsigned int address, unsigned int value)
 {
+    backup_ram_dirty = true;
+    backup_ram_remap();
     address &= 0xFFFF;
-    if (backup_ram_enabled)
-        return BACKUP_RAM[address];
-    return backup_ram_shadow[address];
+    BACKUP_RAM[address] = value >> 8;
+    BACKUP_RAM[address+1] = value & 0xFF;
 }
 
-unsigned int backup_ram_r16(unsigned int address)
+static memfunc_pair BACKUP_RAM_WRITE = { unmapped_mem_r8, unmapped_mem_r16, backup_ram_w8, backup_ram_w16 };
+
+static void backup_ram_init(int page)
 {
-    address &= 0xFFFF;
-    if (backup_ram_enabled)
-        return (BACKUP_RAM[address] << 8) | BACKUP_RAM[address+1];
-    return (backup_ram_shadow[address] << 8) | backup_ram_shadow[address+1];
+    backup_ram_present = true;
+    backup_ram_page = page;
+    CART_REGS[0] |= 1;
+    memset(BACKUP_RAM, 0xFF, BACKUP_RAM_SIZE);  // required by dinodini
 }
 
-void backup_ram_w8(unsigned int address, unsigned int value)
+static void backup_ram_remap(void)
 {
-    address &= 0xFFFF;
-    if (backup_ram_enabled)
-    {
-        BACKUP_RAM[address] = value;
+    if (!backup_ram_present)
         return;
-    }
 
-    assert(!"write to backup RAM when not enabled");
+    if (BIT(CART_REGS[0], 0))
+    {
+        if (backup_ram_dirty || !backup_ram_mapped)
+            mem_map_ram(backup_ram_page, BACKUP_RAM);
+        else
+        {
+            mem_map_rom(backup_ram_page, BACKUP_RAM);
+            m68k_wtable[backup_ram_page].io = &BACKUP_RAM_WRITE;
+        }
+    }
+    else if (backup_ram_page >= 0x40)
+        mem_map_io(backup_ram_page, &UNMAPPED);
 }
 
-void backup_ram_w16(unsigned int address, unsigned int value)
+bool mem_sram_open(const char *fn)
 {
-    address &= 0xFFFF;
-    if (backup_ram_enabled)
+    struct stat st;
+
+    if (!backup_ram_present)
+        return true;
+
+    int fd = open(fn, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (st.st_size < BACKUP_RAM_SIZE && ftruncate(fd, BACKUP_RAM_SIZE) < 0))
     {
-        BACKUP_RAM[address] = value >> 8;
-        BACKUP_RAM[address+1] = value & 0xFF;
-        return;
+        fprintf(stderr, "cannot open backup RAM: %s\n", fn);
+        if (fd >= 0)
+            close(fd);
+        return false;
     }
 
-    assert(!"write to backup RAM when not enabled");
+    uint8_t *mem = (uint8_t*)mmap(NULL, BACKUP_RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "cannot map backup RAM: %s\n", fn);
+        return false;
+    }
+
+    // A new (or short) file starts from the current contents
+    if (st.st_size < BACKUP_RAM_SIZE)
+        memcpy(mem + st.st_size, BACKUP_RAM + st.st_size, BACKUP_RAM_SIZE - st.st_size);
+
+    mem_sram_close();
+    fprintf(stderr, "Backup RAM: %s\n", fn);
+    BACKUP_RAM = mem;
+    backup_ram_mapped = true;
+    backup_ram_remap();
+    return true;
 }
 
-static memfunc_pair BACKUP_RAM_ACCESS = {
-    backup_ram_r8, backup_ram_r16, backup_ram_w8, backup_ram_w16
-};
+void mem_sram_flush(void)
+{
+    if (!backup_ram_dirty || !backup_ram_mapped)
+        return;
 
+    msync(BACKUP_RAM, BACKUP_RAM_SIZE, MS_ASYNC);
+    backup_ram_dirty = false;
+    backup_ram_remap();
+}
 
-static memfunc_pair BACKUP_RAM_SWITCH = {
-    io_mem_r8, io_mem_r16, backup_ram_switch_w8, io_mem_w16
-};
+void mem_sram_close(void)
+{
+    if (backup_ram_mapped)
+    {
+        msync(BACKUP_RAM, BACKUP_RAM_SIZE, MS_SYNC);
+        munmap(BACKUP_RAM, BACKUP_RAM_SIZE);
+    }
+    BACKUP_RAM = backup_ram_mem;
+    backup_ram_mapped = false;
+    backup_ram_dirty = false;
+}
+
+/**************************************
+ * Standard mapper: ROM mirrored in the range 0x00-0x3F (but respect
+ * power-of-two since hardware won't mirror in non-pow2 multiples).
+ **************************************/
 
-void backup_ram_init(uint8_t addr)
+static void sega_remap(void)
 {
-    backup_ram_present = true;
-    backup_ram_enabled = true;
-    backup_ram_shadow = (uint8_t*)m68k_memtable[0x20];
-    m68k_memtable[addr] = MEMFUN_PAIR(&BACKUP_RAM_ACCESS);
-    m68k_memtable[0xA1] = MEMFUN_PAIR(&BACKUP_RAM_SWITCH);
-    memset(BACKUP_RAM, 0xFF, sizeof(BACKUP_RAM));  // required by dinodini
+    int pow2 = 1;
+    while (pow2 < ROM_PAGES)
+        pow2 <<= 1;
+
+    for (int j=0;j<0x40;j+=pow2)
+    {
+        TRACE(TRACE_CARTIDGE, "Mirror from %02x0000\n", j);
+        for (int i=0;i<ROM_PAGES && i+j<0x40;++i)
+            mem_map_rom(i+j, ROM + i*65536);
+    }
 }
 
+static const cart_mapper MAPPER_SEGA = { "standard", 0x00, sega_remap };
+
 /**************************************
  * Super Street Fighter 2
  *
  * This game has an additional ROM bankswitch because
- * it's got a 5MB cartidge
+ * it's got a 5MB cartidge: 0xA130F3-0xA130FF select the
+ * 512KB bank seen at 0x080000-0x3FFFFF.
  **************************************/
 
-unsigned int ssf2_bankswitch_r8(unsigned int address)
+static void ssf2_remap(void)
 {
-    return io_mem_r8(address);
+    map_rom_bank(0x00, 0);
+    for (int i=1;i<8;++i)
+    {
+        TRACE(TRACE_CARTIDGE, "SSF2 bankswitch: base:%x banknum:%x\n", i*8, CART_REGS[i]);
+        map_rom_bank(i*8, CART_REGS[i] & 0x3F);
+    }
 }
 
-unsigned int ssf2_bankswitch_r16(unsigned int address)
-{
-    return io_mem_r16(address);
-}
+static const cart_mapper MAPPER_SSF2 = { "SSF2", 0xFE, ssf2_remap };
 
-void ssf2_bankswitch_w8(unsigned int address, unsigned int value)
+/**************************************
+ * ROM database
+ **************************************/
+
+struct cart_info
 {
-    int base = 0;
+    const char *code;           // product code in the header
+    uint16_t checksum;          // header checksum (0: any)
+    const cart_mapper *mapper;
+    uint8_t backup_ram_page;    // 0: none (or as declared in the header)
+};
 
-    switch (address)
-    {
-    case 0xA130F3: base = 0x08; break;
-    case 0xA130F5: base = 0x10; break;
-    case 0xA130F7: base = 0x18; break;
-    case 0xA130F9: base = 0x20; break;
-    case 0xA130FB: base = 0x28; break;
-    case 0xA130FD: base = 0x30; break;
-    case 0xA130FF: base = 0x38; break;
-    case 0xA130F1:
-        if (backup_ram_present)
-        {
-            backup_ram_switch_w8(address, value);
-            return;
-        }
-        /* fallthrough */
-    default:
-        io_mem_w8(address, value);
-        return;
+static const cart_info CART_DB[] = {
+    { "GM MK-1079 ", 0, &MAPPER_SEGA, 0x20 },   // Sonic3
+    { "GM MK-1304 ", 0, &MAPPER_SEGA, 0x20 },   // Warriors of the sun
+    { "GM T-172176", 0, &MAPPER_SEGA, 0x20 },   // NHL98
+    { "GM T-172186", 0, &MAPPER_SEGA, 0x20 },   // NBA98
+    { "GM MK-1354 ", 0, &MAPPER_SSF2, 0x20 },   // Story of thor
+    { "GM MK-12056", 0, &MAPPER_SSF2, 0 },      // Super Street Fighter 2
+};
 
+static const cart_info *cartidge_lookup(const char *code, uint16_t checksum)
+{
+    for (size_t i=0;i<sizeof(CART_DB)/sizeof(CART_DB[0]);++i)
+    {
+        const cart_info &info = CART_DB[i];
+        if (memcmp(code, info.code, 10) == 0 && (!info.checksum || info.checksum == checksum))
+            return &info;
     }
-
-    mem_log("CARTIDGE", "SSF2 bankswitch: base:%x banknum:%x\n", base, value);
-
-    assert(value < 5*1024*1024 / 512*1024);
-    uint8_t *rom = ROM + 512*1024 * value;
-
-    for (int i=0;i<0x8;++i)
-        m68k_memtable[base+i] = rom + 0x10000*i;
+    return NULL;
 }
 
-void ssf2_bankswitch_w16(unsigned int address, unsigned int value)
+// Rebuild the cartridge area of the memory map after CART_REGS changed
+void cartidge_remap(void)
 {
-    io_mem_w16(address, value);
+    MAPPER->remap();
+    backup_ram_remap();
 }
 
+static void cartidge_w8(unsigned int address, unsigned int value)
+{
+    int reg = BITS(address, 1, 3);
+    uint8_t regs = MAPPER->regs | (backup_ram_present ? 0x01 : 0x00);
 
-static memfunc_pair SSF2_BANKSWITCH = {
-    ssf2_bankswitch_r8, ssf2_bankswitch_r16, ssf2_bankswitch_w8, ssf2_bankswitch_w16
-};
+    if (!(address & 1) || !BIT(regs, reg))
+    {
+        mem_err("MEM", "write8 to cartidge register %06x: %02x\n", address, value);
+        return;
+    }
 
+    CART_REGS[reg] = value;
+    cartidge_remap();
+}
 
-void cartidge_init(void)
+void cartidge_init(int romsize)
 {
     char name[64], region[64], code[64];
 
@@ -174,31 +284,33 @@ void cartidge_init(void)
         VERSION_PAL = 1;
     }
 
+    ROM_PAGES = romsize / 65536;
+    for (int i=0;i<8;++i)
+        CART_REGS[i] = i;       // SSF2 banks start in order
+    CART_REGS[0] = 0;
+    backup_ram_present = false;
+    mem_sram_close();
+
+    const cart_info *info = cartidge_lookup(code, FETCH16(ROM + 0x18E));
+    MAPPER = info ? info->mapper : &MAPPER_SEGA;
+    if (MAPPER != &MAPPER_SEGA)
+        fprintf(stderr, "Mapper: %s\n", MAPPER->name);
+
     if (ROM[0x1B0] == 'R' && ROM[0x1B1] == 'A')
     {
-        uint32_t start = m68k_read_memory_32(0x1b4);
-        uint32_t end = m68k_read_memory_32(0x1b8);
-        fprintf(stderr, "Extra RAM definition: type:%02x start:%06x end:%06x\n", 
-            m68k_read_memory_8(0x1b2), start, end);
+        uint32_t start = (FETCH16(ROM + 0x1B4) << 16) | FETCH16(ROM + 0x1B6);
+        uint32_t end = (FETCH16(ROM + 0x1B8) << 16) | FETCH16(ROM + 0x1BA);
+        fprintf(stderr, "Extra RAM definition: type:%02x start:%06x end:%06x\n",
+            ROM[0x1B2], start, end);
         backup_ram_init((start >> 16) & 0xFF);
     }
-    else
-    if (memcmp(code, "GM MK-1079 ", 10) == 0 ||   // Sonic3
-        memcmp(code, "GM MK-1304 ", 10) == 0 ||   // Warriors of the sun
-        memcmp(code, "GM T-172176", 10) == 0 ||   // NHL98
-        memcmp(code, "GM T-172186", 10) == 0 ||   // NBA98
-        memcmp(code, "GM MK-1354 ", 10) == 0)     // Story of thor
+    else if (info && info->backup_ram_page)
     {
-        mem_log("CARTIDGE", "Backup RAM\n");
-        backup_ram_init(0x20);
+        TRACE(TRACE_CARTIDGE, "Backup RAM\n");
+        backup_ram_init(info->backup_ram_page);
     }
 
-    // Bankswitcher
-    if (memcmp(code, "GM MK-12056", 10) == 0 ||   // Super Street Fighter 2
-        memcmp(code, "GM MK-1354 ", 10) == 0)     // Story of thor
-    {
-        m68k_memtable[0xA1] = MEMFUN_PAIR(&SSF2_BANKSWITCH);
-    }
+    cartidge_remap();
 
     fprintf(stderr, "Autodetect mode: %s\n", VERSION_PAL ? "PAL" : "NTSC");
 }
@@ -1,29 +1,124 @@
 #include "vdp.h"
 #include "mem.h"
 #include "cpu.h"
+#include "trace.h"
+#include <string.h>
+extern "C" {
+    #include "m68k/m68kcpu.h"
+}
 
-int activecpu;
+MACHINE_LOCAL int activecpu;
 
-CpuM68K CPU_M68K;
-CpuZ80 CPU_Z80;
+MACHINE_LOCAL CpuM68K CPU_M68K;
+MACHINE_LOCAL CpuZ80 CPU_Z80;
 
 void CpuM68K::init(void)
 {
     _clock = 0;
+    _running = false;
     m68k_init();
     m68k_set_cpu_type(M68K_CPU_TYPE_68000);
+    m68k_set_irq(0);
+}
+
+/**************************************
+ * Idle loop detection
+ *
+ * Games often spin waiting for an interrupt, polling a RAM flag or the
+ * VDP status. If a backward branch is taken twice in a row with the same
+ * registers, and in between the 68000 didn't write anything nor access
+ * I/O (see mem_idle_epoch), the next iterations are going to be identical
+ * until something external happens: the end of the timeslice, or the
+ * horizon declared by a stable I/O read (the VDP status). So they are
+ * skipped by just consuming their cycles, which gives exactly the same
+ * result as running them.
+ **************************************/
+
+struct idle_loop
+{
+    uint32_t ppc;       // address of the branch
+    uint32_t sr;
+    uint32_t regs[16];  // D0-D7, A0-A7
+    uint32_t epoch;
+    int remaining;      // cycles left in the timeslice
+};
+
+static MACHINE_LOCAL bool idle_skip = true;
+static MACHINE_LOCAL idle_loop idle;
+static MACHINE_LOCAL uint64_t idle_skipped;
+
+void m68k_backward_branch(void)
+{
+    if (!idle_skip)
+        return;
+
+    uint32_t sr = m68ki_get_sr();
+    int remaining = GET_CYCLES();
+
+    if (REG_PPC == idle.ppc && mem_idle_epoch == idle.epoch && sr == idle.sr &&
+        memcmp(REG_DA, idle.regs, sizeof(idle.regs)) == 0)
+    {
+        // Stop one iteration before the end of the timeslice (or the
+        // horizon), so that the last one runs normally.
+        int cycles = idle.remaining - remaining;
+        int n = cycles > 0 && remaining > 0 ? (remaining - 1) / cycles : 0;
+
+        if (n > 0 && mem_idle_horizon != ~(uint64_t)0)
+        {
+            uint64_t clock = CPU_M68K.clock();
+            uint64_t span = (uint64_t)cycles * M68K_FREQ_DIVISOR;
+            uint64_t max = mem_idle_horizon > clock ? (mem_idle_horizon - clock) / span : 0;
+            n = MIN((uint64_t)n, max);
+        }
+
+        if (n > 0)
+        {
+            TRACE(TRACE_M68K, "idle loop at %06x: skipped %d iterations of %d cycles\n",
+                REG_PC, n, cycles);
+            USE_CYCLES(n * cycles);
+            idle_skipped += (uint64_t)n * cycles * M68K_FREQ_DIVISOR;
+            remaining = GET_CYCLES();
+        }
+    }
+
+    idle.ppc = REG_PPC;
+    idle.sr = sr;
+    memcpy(idle.regs, REG_DA, sizeof(idle.regs));
+    idle.epoch = mem_idle_epoch;
+    idle.remaining = remaining;
+    mem_idle_horizon = ~(uint64_t)0;
+}
+
+void CpuM68K::set_idle_skip(bool enable)
+{
+    idle_skip = enable;
+}
+
+uint64_t CpuM68K::idle_cycles(void)
+{
+    return idle_skipped;
 }
 
 void CpuM68K::run(uint64_t target)
 {
+    if (_clock >= target)
+        return;
     ::activecpu = 0;
-    //mem_log("M68K", "Running %d cycles (from %ld to %ld)\n", (target - m68k_clock) / M68K_FREQ_DIVISOR, m68k_clock, target);
-    m68k_execute((target - _clock) / M68K_FREQ_DIVISOR);
-    _clock = target;
+    idle.ppc = ~0;
+    //TRACE(TRACE_M68K, "Running %d cycles (from %ld to %ld)\n", (target - m68k_clock) / M68K_FREQ_DIVISOR, m68k_clock, target);
+
+    // Run at least up to target; the overshoot of the last instruction
+    // is kept in _clock and paid back in the next timeslice.
+    _running = true;
+    int cycles = m68k_execute((target - _clock + M68K_FREQ_DIVISOR - 1) / M68K_FREQ_DIVISOR);
+    _running = false;
+    _clock += (uint64_t)cycles * M68K_FREQ_DIVISOR;
 }
 
 uint64_t CpuM68K::clock(void)
 {
+    if (!_running)
+        return _clock;
     return _clock + m68k_cycles_run() * M68K_FREQ_DIVISOR;
 }
 
@@ -55,14 +150,18 @@ void CpuZ80::run(uint64_t target)
 {
     if (_clock >= target)
         return;
-    ::activecpu = 1;
-    _cur_timeslice = (target - _clock) / Z80_FREQ_DIVISOR;
-    int rem = 0;
-    if (_reset_once && !_reset_line && !_busreq_line)
+
+    // While held in reset or BUSREQ, time just flows
+    if (halted())
     {
-        //mem_log("Z80", "Running %d cycles\n", _cur_timeslice);
-        rem = ExecZ80(&_cpu, _cur_timeslice);
+        _clock = target;
+        return;
     }
+
+    ::activecpu = 1;
+    _cur_timeslice = (target - _clock) / Z80_FREQ_DIVISOR;
+    //TRACE(TRACE_Z80, "Running %d cycles\n", _cur_timeslice);
+    int rem = ExecZ80(&_cpu, _cur_timeslice);
     _clock = target - rem*Z80_FREQ_DIVISOR;
     _cur_timeslice = 0;
     ::activecpu = 0;
@@ -70,12 +169,14 @@ void CpuZ80::run(uint64_t target)
 
 uint64_t CpuZ80::clock(void)
 {
+    if (!_cur_timeslice)
+        return _clock;
     return _clock + (_cur_timeslice - _cpu.ICount)*Z80_FREQ_DIVISOR;
 }
 
 void CpuZ80::sync(void)
 {
-    mem_log("Z80", "Sync up to: %ld\n", CPU_M68K.clock());
+    TRACE(TRACE_Z80, "Sync up to: %ld\n", CPU_M68K.clock());
     run(CPU_M68K.clock());
 }
 
@@ -93,7 +194,7 @@ void CpuZ80::set_busreq_line(bool line)
 {
     sync();
     _busreq_line = line;
-    mem_log("MEM", "Z80 BUSREQ: %d\n", line);
+    TRACE(TRACE_MEM, "Z80 BUSREQ: %d\n", line);
 }
 
 bool CpuZ80::set_reset_line(bool line)
@@ -101,7 +202,7 @@ bool CpuZ80::set_reset_line(bool line)
     if (line == _reset_line)
         return false;
     _reset_line = line;
-    mem_log("MEM", "Z80 RESET: %d (CLOCK: %d)\n", line, _clock);
+    TRACE(TRACE_MEM, "Z80 RESET: %d (CLOCK: %d)\n", line, _clock);
     if (_reset_line)
     {
         // RESET is asserted, save the time
@@ -111,14 +212,14 @@ bool CpuZ80::set_reset_line(bool line)
     {
         if (clock() >= _reset_start + (4*8)*Z80_FREQ_DIVISOR)
         {
-            mem_log("Z80", "Reset triggered (%ld, %ld)\n", clock(), _reset_start);
+            TRACE(TRACE_Z80, "Reset triggered (%ld, %ld)\n", clock(), _reset_start);
             ResetZ80(&_cpu);
             _reset_once = true;
             _clock += 20*Z80_FREQ_DIVISOR;
             return true;
         }
         else
-            mem_log("Z80", "Reset ignored for too short pulse\n");
+            TRACE(TRACE_Z80, "Reset ignored for too short pulse\n");
     }
 
     return false;
@@ -1,3 +1,4 @@
+#include "machine.h"
 
 extern "C" {
     #include "m68k/m68k.h"
@@ -7,6 +8,7 @@ extern "C" {
 class CpuM68K
 {
     uint64_t _clock;
+    bool _running;
 
 public:
     void init();
@@ -16,6 +18,11 @@ public:
     uint64_t clock();
     unsigned int PC() { return m68k_get_reg(0, M68K_REG_PC); }
     unsigned int PPC() { return m68k_get_reg(0, M68K_REG_PPC); }
+
+    // Skip the iterations of idle loops (see cpu.cpp); enabled by default.
+    // idle_cycles() is the number of master clock cycles skipped so far.
+    void set_idle_skip(bool enable);
+    uint64_t idle_cycles();
 };
 
 class CpuZ80
@@ -46,10 +53,12 @@ public:
     void set_busreq_line(bool assert);
     bool get_busreq_line() { return _busreq_line; };
 
+    bool halted() { return !_reset_once || _reset_line || _busreq_line; }
+
     void set_irq_line(bool assert);
 };
 
-extern CpuM68K CPU_M68K;
-extern CpuZ80 CPU_Z80;
+extern MACHINE_LOCAL CpuM68K CPU_M68K;
+extern MACHINE_LOCAL CpuZ80 CPU_Z80;
 
 
@@ -1,4 +1,5 @@
 #include "hw.h"
+#include <SDL.h>
 extern "C" {
     #include "ym2612/ym2612.h"
 }
@@ -7,15 +8,108 @@ extern "C" {
 #include "gfx.h"
 #include "mem.h"
 #include "state.h"
+#include "rewind.h"
+#include "movie.h"
+#include "ioports.h"
+#include "prof.h"
+#include "machine.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include "ezOptionParser.hpp"
 
-int framecounter;
-uint64_t MASTER_CLOCK;   // VDP_MASTER_FREQ
 char romname[2048];
-extern int VERSION_PAL;
+
+// Frames skipped for each displayed one while fast-forwarding (TAB)
+#define TURBO_FRAMESKIP  7
+
+// Rewind history (BACKSPACE): a snapshot every REWIND_INTERVAL frames
+#define REWIND_BUFFER_SIZE  (16*1024*1024)
+#define REWIND_INTERVAL     5
+
+static char* slotname(int slot)
+{
+    static char savename[2048];
+    char *ext;
+
+    strcpy(savename, romname);
+    ext = &savename[strlen(savename)-3];
+    *ext++ = 'g'; *ext++ = 's';
+    *ext++ = '0' + slot;
+    return savename;
+}
+
+static void state_poll()
+{
+    static const int savekeys[] = {
+        SDL_SCANCODE_0, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
+        SDL_SCANCODE_5, SDL_SCANCODE_6, SDL_SCANCODE_7, SDL_SCANCODE_8, SDL_SCANCODE_9
+    };
+
+    if (keystate[SDL_SCANCODE_LCTRL])
+    {
+        for (int i=0;i<10;i++)
+            if (keyreleased[savekeys[i]])
+                savestate(slotname(i));
+    }
+    else if (keystate[SDL_SCANCODE_LSHIFT])
+    {
+        for (int i=0;i<10;i++)
+            if (keyreleased[savekeys[i]])
+                loadstate(slotname(i));
+    }
+}
+
+// Run-ahead: emulate the real frame without drawing it, then peek "frames"
+// frames into the future (drawing only the last one, and discarding
+// their audio and backup RAM writes) and go back. The game reacts to the input in the frame
+// presented, hiding its internal lag frames.
+static void run_frame_ahead(Machine &machine, int frames, uint8_t *screen, int pitch, int16_t *audio, int nsamples)
+{
+    // Audio is still generated (YM2612 timers need to run), then discarded
+    static int16_t scratch_audio[(YM2612_FREQ/50 + 1) * 2];
+    static std::vector<uint8_t> snapshot;
+
+    snapshot.resize(state_size());
+
+    machine.run_frame(NULL, pitch, audio, nsamples);
+    state_save_to(&snapshot[0]);
+    for (int i=0;i<frames;i++)
+        machine.run_frame_speculative(i == frames-1 ? screen : NULL, pitch, scratch_audio, nsamples);
+    state_load_from(&snapshot[0]);
+}
+
+// Step back in the rewind history while the key is held
+// (not while a movie is active, it would go out of sync)
+static bool rewind_poll()
+{
+    return keystate[SDL_SCANCODE_BACKSPACE] && !movie_active() && rewind_step();
+}
+
+// Translate keyboard state into pad buttons and debug layer toggles
+static void input_poll()
+{
+    // Same order as PAD_* bits
+    static const int keymap[8] = {
+        SDL_SCANCODE_UP, SDL_SCANCODE_DOWN, SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT,
+        SDL_SCANCODE_RETURN, SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C
+    };
+
+    uint8_t buttons = 0;
+    for (int i=0;i<8;i++)
+        if (keystate[keymap[i]])
+            buttons |= 1<<i;
+    ioports_set_pad(0, buttons);
+
+    int layers = 0;
+    if (keystate[SDL_SCANCODE_A]) layers |= GFX_LAYER_A;
+    if (keystate[SDL_SCANCODE_B]) layers |= GFX_LAYER_B;
+    if (keystate[SDL_SCANCODE_W]) layers |= GFX_LAYER_W;
+    if (keystate[SDL_SCANCODE_S]) layers |= GFX_LAYER_SPRITES;
+    if (keystate[SDL_SCANCODE_H]) layers |= GFX_LAYER_SHI;
+    gfx_disable_layers(layers);
+}
 
 int main(int argc, const char *argv[])
 {
@@ -28,6 +122,15 @@ int main(int argc, const char *argv[])
     opt.add("",0,1,0,"Force console type [accepted values: PAL or NTSC]", "--mode", "--type");
     opt.add("",0,-1,',',"Make screenshots on the specified frames and exit", "--screenshots");
     opt.add("",0,1,0,"Load from saved state", "--load");
+    opt.add("",0,1,0,"Run the specified number of frames headless and print timings", "--bench");
+    opt.add("",0,0,0,"Don't skip the idle loops of the 68000 (the result is the same, only slower)", "--no-idle-skip");
+    opt.add("",0,1,0,"Fast-forward: show only one frame every N+1, running at (N+1)x speed", "--frameskip");
+    opt.add("",0,1,0,"Run-ahead: show the frame N frames in the future to hide lag", "--runahead");
+    opt.add("",0,1,0,"Record the pad input into the specified movie file", "--record");
+    opt.add("",0,1,0,"Play back the pad input from the specified movie file", "--play");
+    opt.add("",0,1,0,"Keep the battery-backed RAM in the specified file [default: ROM name with .srm]", "--sram");
+    opt.add("",0,-1,',',"Trace the specified categories [M68K,MEM,VDP,DMA,Z80,IOPORTS,CARTIDGE,GFX,PSG,YM2612 or ALL]", "--trace");
+    opt.add("genemu.trace",0,1,0,"Write the trace into the specified file (decode it with genemu-tracedump)", "--trace-file");
 
     opt.parse(argc, argv);
     if (opt.isSet("-h"))
@@ -50,12 +153,10 @@ int main(int argc, const char *argv[])
         return 2;
     }
 
-    int romsize;
-    if (strstr(romname, ".smd"))
-        romsize = load_smd(romname);
-    else
-        romsize = load_bin(romname);
-    mem_init(romsize);
+    Machine machine;
+    if (!machine.load_rom(romname))
+        return 1;
+    int romsize = machine.romsize();
 
 #if 0
     uint16_t checksum = 0;
@@ -78,18 +179,19 @@ int main(int argc, const char *argv[])
     fclose(f);
 #endif
 
+    bool pal = machine.pal();
     if (opt.isSet("--mode"))
     {
         std::string mode;
         opt.get("--mode")->getString(mode);
         if (mode == "PAL")
         {
-            VERSION_PAL = 1;
+            pal = true;
             std::cerr << "Forced mode: PAL\n";
         }
         else if (mode == "NTSC")
         {
-            VERSION_PAL = 0;
+            pal = false;
             std::cerr << "Forced mode: NTSC\n";
         }
         else
@@ -99,28 +201,127 @@ int main(int argc, const char *argv[])
         }
     }
 
+    // A movie replays in the region it was recorded in. It must be known
+    // now, as the audio buffers and the frame rate depend on it.
+    if (opt.isSet("--play"))
+    {
+        std::string fn;
+        bool movie_pal;
+        opt.get("--play")->getString(fn);
+        if (!movie_region(fn.c_str(), &movie_pal))
+            return 1;
+        if (opt.isSet("--mode") && movie_pal != pal)
+        {
+            std::cerr << "ERROR: --mode conflicts with the movie, which was recorded in "
+                << (movie_pal ? "PAL" : "NTSC") << " mode\n";
+            return 2;
+        }
+        pal = movie_pal;
+    }
+
+    // Power on again in the new region
+    if (pal != machine.pal())
+    {
+        machine.set_pal(pal);
+        machine.reset();
+    }
+
     std::vector<int> ss_frames;
     int ss_idx = 0;
+    int bench_frames = 0;
+    int frameskip = 0;
+    int runahead = 0;
 
-    hw_init(YM2612_FREQ, VERSION_PAL ? 50 : 60);
+    if (opt.isSet("--runahead"))
+    {
+        opt.get("--runahead")->getInt(runahead);
+        if (runahead < 0)
+        {
+            std::cerr << "ERROR: invalid value for --runahead\n";
+            return 2;
+        }
+    }
 
-    if (!opt.isSet("--screenshots"))
+    if (opt.isSet("--frameskip"))
     {
+        opt.get("--frameskip")->getInt(frameskip);
+        if (frameskip < 0)
+        {
+            std::cerr << "ERROR: invalid value for --frameskip\n";
+            return 2;
+        }
+    }
+
+    if (opt.isSet("--no-idle-skip"))
+        CPU_M68K.set_idle_skip(false);
+
+    if (opt.isSet("--bench"))
+    {
+        opt.get("--bench")->getInt(bench_frames);
+        if (bench_frames <= 0)
+        {
+            std::cerr << "ERROR: invalid number of frames for --bench\n";
+            return 2;
+        }
+
+        // No window, no audio device: measure raw emulation speed
+        hw_init_headless(YM2612_FREQ, machine.pal() ? 50 : 60);
+        gfx_enable(true);
+        prof_enabled = true;
+    }
+    else if (!opt.isSet("--screenshots"))
+    {
+        hw_init(YM2612_FREQ, machine.pal() ? 50 : 60);
         hw_enable_video(true);
         hw_enable_audio(true);
         gfx_enable(true);
+        rewind_init(REWIND_BUFFER_SIZE, REWIND_INTERVAL);
     }
     else
     {
+        hw_init(YM2612_FREQ, machine.pal() ? 50 : 60);
         opt.get("--screenshots")->getInts(ss_frames);
     }
 
-    CPU_M68K.init();
-    CPU_Z80.init();
+    if (opt.isSet("--load") && (opt.isSet("--record") || opt.isSet("--play")))
+    {
+        std::cerr << "ERROR: movies start from power-on, they can't be used with --load\n";
+        return 2;
+    }
+    if (opt.isSet("--record"))
+    {
+        std::string fn;
+        opt.get("--record")->getString(fn);
+        if (!movie_record(fn.c_str()))
+            return 1;
+    }
+    else if (opt.isSet("--play"))
+    {
+        std::string fn;
+        opt.get("--play")->getString(fn);
+        if (!movie_play(fn.c_str()))
+            return 1;
+    }
 
-    MASTER_CLOCK = 0;
-    CPU_M68K.reset();
-    VDP.reset();
+    // Benchmarks, screenshots and movies must be reproducible, so they
+    // don't see the backup RAM of previous sessions unless asked to.
+    if (opt.isSet("--sram") ||
+        !(bench_frames || opt.isSet("--screenshots") || opt.isSet("--record") || opt.isSet("--play")))
+    {
+        std::string srmname;
+        if (opt.isSet("--sram"))
+            opt.get("--sram")->getString(srmname);
+        else
+        {
+            // Replace the extension of the ROM file (if any) with .srm
+            srmname = romname;
+            const char *dot = strrchr(romname, '.');
+            if (dot && !strchr(dot, '/'))
+                srmname.resize(dot - romname);
+            srmname += ".srm";
+        }
+        machine.load_sram(srmname.c_str());
+    }
 
     if (opt.isSet("--load"))
     {
@@ -129,14 +330,53 @@ int main(int argc, const char *argv[])
         loadstate(sn.c_str());
     }
 
-    while (hw_poll())
+    if (opt.isSet("--trace"))
     {
+        std::vector<std::string> cats;
+        uint32_t mask = 0;
+        opt.get("--trace")->getStrings(cats);
+        for (int i=0;i<cats.size();++i)
+        {
+            uint32_t m;
+            if (!trace_parse(cats[i].c_str(), &m))
+            {
+                std::cerr << "ERROR: unknown trace category: " << cats[i] << std::endl;
+                return 2;
+            }
+            mask |= m;
+        }
+        trace_enable(mask, 256*1024);
+    }
+
+    if (bench_frames)
+    {
+        prof_reset();
+        mem_heatmap_reset();
+    }
+
+    while (bench_frames ? machine.frame() < bench_frames : hw_poll())
+    {
+        bool rewinding = !bench_frames && rewind_poll();
+        int framecounter = machine.frame();
+
         if (ss_idx < ss_frames.size() && framecounter == ss_frames[ss_idx])
         {
             gfx_enable(true);
         }
 
-        int numscanlines = VDP.num_scanlines();
+        if (!bench_frames)
+            input_poll();
+        if (!movie_frame())
+            std::cerr << "Movie finished at frame " << framecounter << std::endl;
+
+        // Skipped frames are emulated without composing the screen, and
+        // are not presented: they don't wait for vsync nor for the audio,
+        // whose samples are simply overwritten by the next frame.
+        int skip = (!bench_frames && keystate[SDL_SCANCODE_TAB]) ? TURBO_FRAMESKIP : frameskip;
+        bool skipped = skip && (framecounter % (skip+1)) != 0;
+        bool ss_frame = ss_idx < ss_frames.size() && framecounter == ss_frames[ss_idx];
+        if (ss_frame)
+            skipped = false;
 
         uint8_t *screen;
         int pitch;
@@ -144,27 +384,18 @@ int main(int argc, const char *argv[])
 
         int16_t *audio; int nsamples;
         hw_beginaudio(&audio, &nsamples);
-        int audio_index = 0;
-        int audio_step = (nsamples << 16) / numscanlines;
-
-        for (int sl=0;sl<numscanlines;++sl)
-        {
-            CPU_M68K.run(MASTER_CLOCK + VDP_CYCLES_PER_LINE);
-            CPU_Z80 .run(MASTER_CLOCK + VDP_CYCLES_PER_LINE);
 
-            vdp_scanline(screen);
-            screen += pitch;
-
-            int prev_index = audio_index;
-            audio_index += audio_step;
-            YM2612Update(audio + ((prev_index+0x8000)>>16)*2, (audio_index-prev_index+0x8000)>>16);
+        if (runahead && !skipped && !ss_frame)
+            run_frame_ahead(machine, runahead, screen, pitch, audio, nsamples);
+        else
+            machine.run_frame(skipped ? NULL : screen, pitch, audio, nsamples);
 
-            MASTER_CLOCK += VDP_CYCLES_PER_LINE;
+        if (!skipped)
+        {
+            hw_endaudio();
+            hw_endframe();
         }
 
-        hw_endaudio();
-        hw_endframe();
-
         if (framecounter == 100 && opt.isSet("--gamegenie"))
         {
             std::vector<std::string> codes;
@@ -176,11 +407,11 @@ int main(int argc, const char *argv[])
         if (ss_idx < ss_frames.size() && framecounter == ss_frames[ss_idx])
         {
             static char ssname[2048];
-            sprintf(ssname, "%s.%d.%s.bmp", romname, framecounter, (VERSION_PAL ? "PAL" : "NTSC"));
+            sprintf(ssname, "%s.%d.%s.bmp", romname, framecounter, (machine.pal() ? "PAL" : "NTSC"));
             std::cerr << "Saving screenshot " << ssname << std::endl;
             hw_save_screenshot(ssname);
 
-            sprintf(ssname, "%s.%d.%s.gs", romname, framecounter, (VERSION_PAL ? "PAL" : "NTSC"));
+            sprintf(ssname, "%s.%d.%s.gs", romname, framecounter, (machine.pal() ? "PAL" : "NTSC"));
             savestate(ssname);
 
             ++ss_idx;
@@ -188,8 +419,27 @@ int main(int argc, const char *argv[])
                 break;
         }
 
-        ++framecounter;
-        state_poll();
+        if (!rewinding)
+            rewind_frame();
+        if (!bench_frames)
+            state_poll();
+    }
+
+    if (opt.isSet("--trace"))
+    {
+        std::string fn;
+        opt.get("--trace-file")->getString(fn);
+        if (trace_dump(fn.c_str()))
+            std::cerr << "Trace written to " << fn << std::endl;
+    }
+
+    if (bench_frames)
+    {
+        prof_report(machine.frame());
+        if (CPU_M68K.clock())
+            fprintf(stderr, "  68000 idle loops skipped: %.1f%% of the emulated time\n",
+                CPU_M68K.idle_cycles() * 100.0 / CPU_M68K.clock());
+        mem_heatmap_report(machine.frame());
     }
 
 #if 0
@@ -1,36 +1,77 @@
 #include "vdp.h"
+#include "gfx.h"
 #include "mem.h"
+#include "trace.h"
 #include <assert.h>
 #include <memory.h>
 #include <stdio.h>
-#include <SDL.h>
-extern "C" {
-    #include "hw.h"
-}
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #define SCREEN_WIDTH 320
 
+static MACHINE_LOCAL int g_disabled_layers;
+
+// Patterns decoded to one pixel per byte, as they are and flipped
+// horizontally: [pattern][fliph][row][pixel]. Allocated by gfx_alloc.
+static MACHINE_LOCAL uint8_t (*PATTERN_CACHE)[2][8][8];
+MACHINE_LOCAL uint32_t GFX_DIRTY_PATTERNS[0x800/32];
+
+// Sprite list parsed from the SAT cache, in link order, and the
+// sprites (positions in the list) that intersect each line
+struct sprite_entry
+{
+    uint8_t sidx;
+    uint8_t sh;         // height in cells
+    int16_t sy;
+};
+
+static MACHINE_LOCAL sprite_entry SPRITE_LIST[80];
+static MACHINE_LOCAL uint8_t (*SPRITE_LINES)[80];       // [240][80], see gfx_alloc
+static MACHINE_LOCAL uint8_t SPRITE_LINES_COUNT[240];
+static MACHINE_LOCAL int sprite_table_size;
+MACHINE_LOCAL bool GFX_DIRTY_SAT;
+
+// Screen color (R,G,B,0) of every pixel value that comes out of the
+// mixer, for the current shadow/highlight mode
+static MACHINE_LOCAL uint8_t PALETTE[256][4];
+static MACHINE_LOCAL bool palette_shi;
+MACHINE_LOCAL bool GFX_DIRTY_CRAM;
+
 class GFX
 {
 private:
-    template <bool fliph>
-    bool FORCE_INLINE draw_pattern(uint8_t *screen, uint8_t *pattern, uint8_t attrs);
+    // Overflow is the maximum size we can draw outside to avoid
+    // wasting time and code in clipping. The maximum object is a 4x4 sprite,
+    // so 32 pixels (on both side) is enough.
+    enum { PIX_OVERFLOW = 32 };
+
+    void decode_pattern(int idx);
+    template <bool check_overdraw>
+    bool draw_row(uint8_t *screen, const uint8_t *row, uint8_t attrs);
     template <bool check_overdraw>
     bool draw_pattern(uint8_t *screen, uint16_t name, int paty);
     void draw_plane_ab(uint8_t *screen, int line, int ntaddr, uint16_t hs, uint16_t *vsram);
     void draw_plane_a(uint8_t *screen, int y);
     void draw_plane_b(uint8_t *screen, int y);
     void draw_plane_w(uint8_t *screen, int y);
+    void parse_sprites(int table_size);
     void draw_sprites(uint8_t *screen, int line);
 
     uint8_t* get_hscroll_vram(int line);
-    inline bool in_window(int x, int y);
+    void window_span(int y, int *start, int *end);
     uint8_t mix(uint8_t back, uint8_t b, uint8_t a, uint8_t s);
+    void mix_line(uint8_t *dst, uint8_t *pb, uint8_t *pa, uint8_t *ps, int n, uint8_t back);
+    void update_palette(bool shi);
 
 public:
     int screen_offset() { return (SCREEN_WIDTH - screen_width()) / 2; }
     int screen_width() { return BIT(VDP.regs[12], 0) ? 40*8 : 32*8; }
 
     void render_scanline(uint8_t *screen, int line);
+    void render_sprites_only(int line);
+    void invalidate_changes(const uint8_t *vram, const uint8_t *cram, const uint8_t *sat_cache);
 
 } GFX;
 
@@ -66,36 +107,46 @@ public:
 #define SHI_IS_SHADOW(x)     (!((x) & 0x80))
 #define SHI_IS_HIGHLIGHT(x)  ((x) & 0x40)
 
-template <bool fliph>
-bool GFX::draw_pattern(uint8_t *screen, uint8_t *pattern, uint8_t attrs)
+void GFX::decode_pattern(int idx)
 {
-    bool overdraw = false;
+    uint8_t *pattern = VDP.VRAM + idx * 32;
+
+    for (int y = 0; y < 8; ++y)
+    {
+        uint8_t *row = PATTERN_CACHE[idx][0][y];
+        uint8_t *flipped = PATTERN_CACHE[idx][1][y];
 
-    if (fliph)
-        pattern += 3;
+        for (int x = 0; x < 4; ++x)
+        {
+            uint8_t pix = *pattern++;
+            row[x*2]   = flipped[7-x*2] = pix >> 4;
+            row[x*2+1] = flipped[6-x*2] = pix & 0xF;
+        }
+    }
+
+    GFX_DIRTY_PATTERNS[idx >> 5] &= ~(1u << (idx & 31));
+}
 
-    for (int x = 0; x < 4; ++x)
+template <bool check_overdraw>
+bool GFX::draw_row(uint8_t *screen, const uint8_t *row, uint8_t attrs)
+{
+    bool overdraw = false;
+
+    // Within each plane, we never overdraw: the pixels can be copied
+    if (!check_overdraw)
     {
-        uint8_t pix = *pattern;
-        uint8_t pix1 = !fliph ? pix>>4 : pix&0xF;
-        uint8_t pix2 = !fliph ? pix&0xF : pix>>4;
-
-        // Never overwrite already-written bytes. This is only
-        // useful for sprites; within each plane, we never overdraw anyway.
-        if ((screen[0] & 0xF) == 0)
-            screen[0] = attrs | pix1;
-        else
-            overdraw |= pix1 & 0xF;
-        if ((screen[1] & 0xF) == 0)
-            screen[1] = attrs | pix2;
-        else
-            overdraw |= pix2 & 0xF;
+        for (int x = 0; x < 8; ++x)
+            screen[x] = attrs | row[x];
+        return false;
+    }
 
-        if (fliph)
-            pattern--;
+    // Never overwrite already-written bytes (sprites)
+    for (int x = 0; x < 8; ++x)
+    {
+        if ((screen[x] & 0xF) == 0)
+            screen[x] = attrs | row[x];
         else
-            pattern++;
-        screen += 2;
+            overdraw |= row[x] != 0;
     }
 
     return overdraw;
@@ -109,22 +160,15 @@ bool GFX::draw_pattern(uint8_t *screen, uint16_t name, int paty)
     int pat_flipv = BITS(name, 12, 1);
     int pat_palette = BITS(name, 13, 2);
     int pat_pri = BITS(name, 15, 1);
-    uint8_t *pattern = VDP.VRAM + pat_idx * 32;
     uint8_t attrs = (pat_palette << 4) | (pat_pri ? PIXATTR_HIPRI : 0);
-    bool overdraw = false;
 
-    if (!pat_flipv)
-        pattern += paty*4;
-    else
-        pattern += (7-paty)*4;
+    if (GFX_DIRTY_PATTERNS[pat_idx >> 5] & (1u << (pat_idx & 31)))
+        decode_pattern(pat_idx);
 
-    if (!pat_fliph)
-        overdraw |= draw_pattern<false>(screen, pattern, attrs);
-    else
-        overdraw |= draw_pattern<true>(screen, pattern, attrs);
+    if (pat_flipv)
+        paty = 7-paty;
 
-    if (!check_overdraw) overdraw=false;  // this is enough to let the optimizer take everything out
-    return overdraw;
+    return draw_row<check_overdraw>(screen, PATTERN_CACHE[pat_idx][pat_fliph][paty], attrs);
 }
 
 void GFX::draw_plane_w(uint8_t *screen, int y)
@@ -133,11 +177,12 @@ void GFX::draw_plane_w(uint8_t *screen, int y)
     int row = y >> 3;
     int paty = y & 7;
     uint16_t ntwidth = (screen_width() == 320 ? 64 : 32);
-    uint8_t *nt = VDP.VRAM + addr_w + row*2*ntwidth;
+    int nt = addr_w + row*2*ntwidth;
 
+    // The nametable wraps around the end of VRAM
     for (int i = 0; i < screen_width() / 8; ++i)
     {
-        draw_pattern<false>(screen, FETCH16(nt), paty);
+        draw_pattern<false>(screen, FETCH16(VDP.VRAM + (nt & 0xFFFF)), paty);
         nt += 2;
         screen += 8;
     }
@@ -153,7 +198,7 @@ void GFX::draw_plane_ab(uint8_t *screen, int line, int ntaddr, uint16_t scrollx,
     bool column_scrolling = BIT(VDP.regs[11], 2);
 
     if (column_scrolling && line==0)
-        mem_log("SCROLL", "column scrolling\n");
+        TRACE(TRACE_GFX, "column scrolling\n");
 
     assert(ntwidth != 2);  // invalid setting
     assert(ntheight != 2); // invalid setting
@@ -190,10 +235,43 @@ void GFX::draw_plane_ab(uint8_t *screen, int line, int ntaddr, uint16_t scrollx,
     }
 }
 
+// Follow the links of the sprite table, and put each sprite into the
+// buckets of the lines it covers. The sprite size and position on Y
+// come from the SAT cache, the other attributes from VRAM.
+void GFX::parse_sprites(int table_size)
+{
+    memset(SPRITE_LINES_COUNT, 0, sizeof(SPRITE_LINES_COUNT));
+
+    // The table size is also the maximum number of sprites that are
+    // processed (important in case of infinite loops in links).
+    int sidx = 0;
+    for (int i = 0; i < table_size && sidx < table_size; ++i)
+    {
+        uint8_t *cache = VDP.SAT_CACHE + sidx*8;
+        sprite_entry &spr = SPRITE_LIST[i];
+
+        spr.sidx = sidx;
+        spr.sy = (((cache[0] & 0x3) << 8) | cache[1]) - 128;
+        spr.sh = BITS(cache[2], 0, 2) + 1;
+
+        int first = MAX((int)spr.sy, 0);
+        int last = MIN(spr.sy + spr.sh*8, 240);
+        for (int line = first; line < last; ++line)
+            SPRITE_LINES[line][SPRITE_LINES_COUNT[line]++] = i;
+
+        int link = BITS(cache[3], 0, 7);
+        if (link == 0) break;
+        sidx = link;
+    }
+
+    sprite_table_size = table_size;
+    GFX_DIRTY_SAT = false;
+}
+
 void GFX::draw_sprites(uint8_t *screen, int line)
 {
     // Plane/sprite disable, show only backdrop
-    if (!BIT(VDP.regs[1], 6) || keystate[SDL_SCANCODE_S])
+    if (!BIT(VDP.regs[1], 6) || (g_disabled_layers & GFX_LAYER_SPRITES))
         return;
 
     uint8_t mask = VDP.mode_h40 ? 0x7E : 0x7F;
@@ -223,7 +301,7 @@ void GFX::draw_sprites(uint8_t *screen, int line)
             int link = BITS(table[3], 0, 7);
             int pat_idx = BITS(name, 0, 11);
 
-            mem_log("SPRITE", "%d (sx:%d, sy:%d sz:%d,%d, name:%04x, link:%02x, VRAM:%04x)\n",
+            TRACE(TRACE_GFX, "%d (sx:%d, sy:%d sz:%d,%d, name:%04x, link:%02x, VRAM:%04x)\n",
                     sidx, sx, sy, sw*8, sh*8, name, link, pat_idx*32);
 
             if (link == 0) break;
@@ -232,75 +310,71 @@ void GFX::draw_sprites(uint8_t *screen, int line)
     }
 #endif
 
+    if (GFX_DIRTY_SAT || sprite_table_size != SPRITE_TABLE_SIZE)
+        parse_sprites(SPRITE_TABLE_SIZE);
+
+    // Only the sprites on this line matter, in the order of the links
     bool masking = false, one_sprite_nonzero = false, overdraw = false;
-    int sidx = 0, num_sprites = 0, num_pixels = 0;
-    for (int i = 0; i < SPRITE_TABLE_SIZE && sidx < SPRITE_TABLE_SIZE; ++i)
+    int num_sprites = 0, num_pixels = 0;
+    for (int i = 0; i < SPRITE_LINES_COUNT[line]; ++i)
     {
-        uint8_t *table = start_table + sidx*8;
-        uint8_t *cache = VDP.SAT_CACHE + sidx*8;
-        int sy = ((cache[0] & 0x3) << 8) | cache[1];
-        int sh = BITS(cache[2], 0, 2) + 1;
-        int link = BITS(cache[3], 0, 7);
+        const sprite_entry &spr = SPRITE_LIST[SPRITE_LINES[line][i]];
+        uint8_t *table = start_table + spr.sidx*8;
+        int sy = spr.sy;
+        int sh = spr.sh;
         uint16_t name = (table[4] << 8) | table[5];
         int flipv = BITS(name, 12, 1);
         int fliph = BITS(name, 11, 1);
         int sw = BITS(table[2], 2, 2) + 1;
         int sx = ((table[6] & 0x3) << 8) | table[7];
 
-        sy -= 128;
-        if (line >= sy && line < sy+sh*8)
+        // Sprite masking: a sprite on column 0 masks
+        // any lower-priority sprite, but with the following conditions
+        //   * it only works from the second visible sprite on each line
+        //   * if the previous line had a sprite pixel overflow, it
+        //     works even on the first sprite
+        // Notice that we need to continue parsing the table after masking
+        // to see if we reach a pixel overflow (because it would affect masking
+        // on next line).
+        if (sx == 0)
         {
-            // Sprite masking: a sprite on column 0 masks
-            // any lower-priority sprite, but with the following conditions
-            //   * it only works from the second visible sprite on each line
-            //   * if the previous line had a sprite pixel overflow, it
-            //     works even on the first sprite
-            // Notice that we need to continue parsing the table after masking
-            // to see if we reach a pixel overflow (because it would affect masking
-            // on next line).
-            if (sx == 0)
-            {
-                if (one_sprite_nonzero || VDP.sprite_overflow == line-1)
-                    masking = true;
-            }
-            else
-                one_sprite_nonzero = true;
-
-            int row = (line - sy) >> 3;
-            int paty = (line - sy) & 7;
-            if (flipv)
-                row = sh - row - 1;
+            if (one_sprite_nonzero || VDP.sprite_overflow == line-1)
+                masking = true;
+        }
+        else
+            one_sprite_nonzero = true;
 
-            sx -= 128;
-            if (sx > -sw*8 && sx < screen_width() && !masking)
-            {
-                name += row;
-                if (fliph)
-                    name += sh*(sw-1);
-                for (int p=0;p<sw && num_pixels < MAX_PIXELS_PER_LINE;p++)
-                {
-                    overdraw |= draw_pattern<true>(screen + sx + p*8, name, paty);
-                    if (!fliph)
-                        name += sh;
-                    else
-                        name -= sh;
-                    num_pixels += 8;
-                }
-            }
-            else
-                num_pixels += sw*8;
+        int row = (line - sy) >> 3;
+        int paty = (line - sy) & 7;
+        if (flipv)
+            row = sh - row - 1;
 
-            if (num_pixels >= MAX_PIXELS_PER_LINE)
+        sx -= 128;
+        if (sx > -sw*8 && sx < screen_width() && !masking)
+        {
+            name += row;
+            if (fliph)
+                name += sh*(sw-1);
+            for (int p=0;p<sw && num_pixels < MAX_PIXELS_PER_LINE;p++)
             {
-                VDP.sprite_overflow = line;
-                break;
+                overdraw |= draw_pattern<true>(screen + sx + p*8, name, paty);
+                if (!fliph)
+                    name += sh;
+                else
+                    name -= sh;
+                num_pixels += 8;
             }
-            if (++num_sprites >= MAX_SPRITES_PER_LINE)
-                break;
         }
+        else
+            num_pixels += sw*8;
 
-        if (link == 0) break;
-        sidx = link;
+        if (num_pixels >= MAX_PIXELS_PER_LINE)
+        {
+            VDP.sprite_overflow = line;
+            break;
+        }
+        if (++num_sprites >= MAX_SPRITES_PER_LINE)
+            break;
     }
 
     if (overdraw)
@@ -335,14 +409,14 @@ uint8_t *GFX::get_hscroll_vram(int line)
 
 void GFX::draw_plane_a(uint8_t *screen, int line)
 {
-    if (keystate[SDL_SCANCODE_A]) return;
+    if (g_disabled_layers & GFX_LAYER_A) return;
     uint16_t hsa = FETCH16(get_hscroll_vram(line) + 0) & 0x3FF;
     draw_plane_ab(screen, line, VDP.get_nametable_A(), hsa, VDP.VSRAM);
 }
 
 void GFX::draw_plane_b(uint8_t *screen, int line)
 {
-    if (keystate[SDL_SCANCODE_B]) return;
+    if (g_disabled_layers & GFX_LAYER_B) return;
     uint16_t hsb = FETCH16(get_hscroll_vram(line) + 2) & 0x3FF;
     draw_plane_ab(screen, line, VDP.get_nametable_B(), hsb, VDP.VSRAM+1);
 }
@@ -373,31 +447,121 @@ uint8_t GFX::mix(uint8_t back, uint8_t b, uint8_t a, uint8_t s)
     return tile;
 }
 
-inline bool GFX::in_window(int x, int y)
+#ifdef __SSE2__
+static inline __m128i blend(__m128i mask, __m128i x, __m128i y)
+{
+    return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+#endif
+
+// Same as mix() on a whole line
+void GFX::mix_line(uint8_t *dst, uint8_t *pb, uint8_t *pa, uint8_t *ps, int n, uint8_t back)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i color = _mm_set1_epi8(0x0F);
+    const __m128i hipri = _mm_set1_epi8((char)PIXATTR_HIPRI);
+    const __m128i tile_back = _mm_set1_epi8(back);
+    bool shi = MODE_SHI;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i b = _mm_loadu_si128((__m128i*)(pb + i));
+        __m128i a = _mm_loadu_si128((__m128i*)(pa + i));
+        __m128i s = _mm_loadu_si128((__m128i*)(ps + i));
+
+        // High priority is the sign bit
+        __m128i tile = blend(_mm_cmpeq_epi8(_mm_and_si128(b, color), zero), tile_back, b);
+        __m128i lose = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(a, color), zero),
+            _mm_andnot_si128(_mm_cmplt_epi8(a, zero), _mm_cmplt_epi8(tile, zero)));
+        tile = blend(lose, tile, a);
+        lose = _mm_or_si128(_mm_cmpeq_epi8(_mm_and_si128(s, color), zero),
+            _mm_andnot_si128(_mm_cmplt_epi8(s, zero), _mm_cmplt_epi8(tile, zero)));
+
+        __m128i pix;
+        if (!shi)
+            pix = blend(lose, tile, s);
+        else
+        {
+            __m128i idx = _mm_and_si128(s, _mm_set1_epi8(0x3F));
+            __m128i normal = _mm_or_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(0x0E)),
+                _mm_or_si128(_mm_cmpeq_epi8(idx, _mm_set1_epi8(0x1E)),
+                             _mm_cmpeq_epi8(idx, _mm_set1_epi8(0x2E))));
+            __m128i spr = blend(normal, _mm_or_si128(s, hipri), s);
+            spr = blend(_mm_cmpeq_epi8(idx, _mm_set1_epi8(0x3E)), _mm_or_si128(tile, _mm_set1_epi8(0x40)), spr);
+            spr = blend(_mm_cmpeq_epi8(idx, _mm_set1_epi8(0x3F)), _mm_and_si128(tile, _mm_set1_epi8(0x3F)), spr);
+
+            tile = _mm_or_si128(tile, _mm_and_si128(_mm_or_si128(b, a), hipri));
+            pix = blend(lose, tile, spr);
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + i), pix);
+    }
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = mix(back, pb[i], pa[i], ps[i]);
+}
+
+// Columns [*start, *end) where the window is shown instead of plane A
+void GFX::window_span(int y, int *start, int *end)
 {
-    if (keystate[SDL_SCANCODE_W]) return false;
+    *start = *end = 0;
+    if (g_disabled_layers & GFX_LAYER_W) return;
 
     int winv = (VDP.regs[18] & 0x1F) * 8;
     bool winvdown = BIT(VDP.regs[18], 7);
 
-    if (winvdown && y >= winv) return true;
-    if (!winvdown && y < winv) return true;
+    if ((winvdown && y >= winv) || (!winvdown && y < winv))
+    {
+        *end = screen_width();
+        return;
+    }
 
-    int winh = (VDP.regs[17] & 0x1F) * 16;
+    int winh = MIN((VDP.regs[17] & 0x1F) * 16, screen_width());
     bool winhright = BIT(VDP.regs[17], 7);
 
-    if (winhright && x >= winh) return true;
-    if (!winhright && x < winh) return true;
+    if (winhright)
+    {
+        *start = winh;
+        *end = screen_width();
+    }
+    else
+        *end = winh;
+}
+
+void GFX::update_palette(bool shi)
+{
+    for (int pix = 0; pix < 256; ++pix)
+    {
+        uint16_t rgb = VDP.CRAM[pix & 0x3F];
+
+        uint8_t r = CRAM_R(rgb);
+        uint8_t g = CRAM_G(rgb);
+        uint8_t b = CRAM_B(rgb);
 
-    return false;
+        if (shi)
+        {
+            if (SHI_IS_HIGHLIGHT(pix))
+                HIGHLIGHT_COLOR(r,g,b);
+            else if (SHI_IS_SHADOW(pix))
+                SHADOW_COLOR(r,g,b);
+        }
+
+        PALETTE[pix][0] = r;
+        PALETTE[pix][1] = g;
+        PALETTE[pix][2] = b;
+        PALETTE[pix][3] = 0;
+    }
+
+    palette_shi = shi;
+    GFX_DIRTY_CRAM = false;
 }
 
 void GFX::render_scanline(uint8_t *screen, int line)
 {
-    // Overflow is the maximum size we can draw outside to avoid
-    // wasting time and code in clipping. The maximum object is a 4x4 sprite,
-    // so 32 pixels (on both side) is enough.
-    enum { PIX_OVERFLOW = 32 };
     uint8_t buffer[4][SCREEN_WIDTH + PIX_OVERFLOW*2];
 
     if (BITS(VDP.regs[12], 1, 2) != 0)
@@ -415,9 +579,9 @@ void GFX::render_scanline(uint8_t *screen, int line)
         int addr_a = VDP.get_nametable_A();
         int addr_b = VDP.get_nametable_B();
         int addr_w = VDP.get_nametable_W();
-        mem_log("GFX", "A(addr:%04x) B(addr:%04x) W(addr:%04x) SPR(addr:%04x)\n", addr_a, addr_b, addr_w, ((VDP.regs[5] & 0x7F) << 9));
-        mem_log("GFX", "W(h:%d, right:%d, v:%d, down:%d\n)", winh, winhright, winv, winvdown);
-        mem_log("GFX", "SCROLL: %04x %04x\n", VDP.VSRAM[0], VDP.VSRAM[1]);
+        TRACE(TRACE_GFX, "A(addr:%04x) B(addr:%04x) W(addr:%04x) SPR(addr:%04x)\n", addr_a, addr_b, addr_w, ((VDP.regs[5] & 0x7F) << 9));
+        TRACE(TRACE_GFX, "W(h:%d, right:%d, v:%d, down:%d\n)", winh, winhright, winv, winvdown);
+        TRACE(TRACE_GFX, "SCROLL: %04x %04x\n", VDP.VSRAM[0], VDP.VSRAM[1]);
 
         FILE *f;
         f=fopen("vram.dmp", "wb");
@@ -454,52 +618,104 @@ void GFX::render_scanline(uint8_t *screen, int line)
     draw_plane_w(pw+screen_offset(), line);
     draw_sprites(ps+screen_offset(), line);
 
-    for (int i=0; i<SCREEN_WIDTH; ++i)
+    uint8_t pixels[SCREEN_WIDTH];
+    memset(pixels, back, sizeof(pixels));
+
+    if (enable_planes)
     {
-        int x = i - screen_offset();
-        uint8_t pix = back;
+        int offset = screen_offset();
+        int start, end;
 
-        if (x >= 0 && x < screen_width())
-        {
-            if (enable_planes)
-            {
-                uint8_t *aw = in_window(x, line) ? pw : pa;
-                pix = mix(back, pb[i], aw[i], ps[i]);
-            }
-        }
+        // The window replaces plane A in its columns
+        window_span(line, &start, &end);
+        memcpy(pa + offset + start, pw + offset + start, end - start);
+        mix_line(pixels + offset, pb + offset, pa + offset, ps + offset, screen_width(), back);
+    }
 
+    bool shi = MODE_SHI && !(g_disabled_layers & GFX_LAYER_SHI);
+    if (GFX_DIRTY_CRAM || palette_shi != shi)
+        update_palette(shi);
 
-        uint8_t index = pix & 0x3F;
-        uint16_t rgb = VDP.CRAM[index];
+    for (int i=0; i<SCREEN_WIDTH; ++i)
+        memcpy(screen + i*4, PALETTE[pixels[i]], 4);
+}
 
-        uint8_t r = CRAM_R(rgb);
-        uint8_t g = CRAM_G(rgb);
-        uint8_t b = CRAM_B(rgb);
+static MACHINE_LOCAL bool g_enabled;
 
-        if (MODE_SHI && !keystate[SDL_SCANCODE_H])
-        {
-            if (SHI_IS_HIGHLIGHT(pix))
-                HIGHLIGHT_COLOR(r,g,b);
-            else if (SHI_IS_SHADOW(pix))
-                SHADOW_COLOR(r,g,b);
-        }
+void gfx_enable(bool enable)
+{
+    g_enabled = enable;
+}
 
-        *screen++ = r;
-        *screen++ = g;
-        *screen++ = b;
-        *screen++ = 0;
-    }
+void gfx_disable_layers(int mask)
+{
+    g_disabled_layers = mask;
+}
+
+bool gfx_alloc(void)
+{
+    PATTERN_CACHE = (uint8_t (*)[2][8][8])malloc(0x800 * sizeof(*PATTERN_CACHE));
+    SPRITE_LINES = (uint8_t (*)[80])malloc(240 * sizeof(*SPRITE_LINES));
+    gfx_invalidate();
+    return PATTERN_CACHE && SPRITE_LINES;
 }
 
-static bool g_enabled;
+void gfx_free(void)
+{
+    free(PATTERN_CACHE);
+    free(SPRITE_LINES);
+    PATTERN_CACHE = NULL;
+    SPRITE_LINES = NULL;
+}
 
-void gfx_enable(bool enable)
+void gfx_invalidate(void)
 {
-    g_enabled = enable;
+    memset(GFX_DIRTY_PATTERNS, 0xFF, sizeof(GFX_DIRTY_PATTERNS));
+    GFX_DIRTY_SAT = true;
+    GFX_DIRTY_CRAM = true;
+}
+
+// Run-ahead and rewind load a snapshot every frame, which usually
+// differs from the current state in just a few patterns
+void GFX::invalidate_changes(const uint8_t *vram, const uint8_t *cram, const uint8_t *sat_cache)
+{
+    for (int idx = 0; idx < 0x800; ++idx)
+        if (memcmp(VDP.VRAM + idx*32, vram + idx*32, 32) != 0)
+            GFX_DIRTY_PATTERNS[idx >> 5] |= 1u << (idx & 31);
+
+    if (memcmp(VDP.SAT_CACHE, sat_cache, sizeof(VDP.SAT_CACHE)) != 0)
+        GFX_DIRTY_SAT = true;
+    if (memcmp(VDP.CRAM, cram, sizeof(VDP.CRAM)) != 0)
+        GFX_DIRTY_CRAM = true;
+}
+
+void gfx_invalidate_changes(const uint8_t *vram, const uint8_t *cram, const uint8_t *sat_cache)
+{
+    GFX.invalidate_changes(vram, cram, sat_cache);
+}
+
+// Skipped frame: don't compose the line, but still run the sprite pass,
+// because it updates the sprite overflow/collision flags that games can
+// read in the status register.
+void GFX::render_sprites_only(int line)
+{
+    uint8_t buffer[SCREEN_WIDTH + PIX_OVERFLOW*2];
+
+    if (line >= (VDP.mode_pal ? 240 : 224))
+        return;
+    if (BIT(VDP.regs[0], 0))
+        return;
+
+    memset(buffer, 0, sizeof(buffer));
+    draw_sprites(&buffer[PIX_OVERFLOW] + screen_offset(), line);
 }
 
 void gfx_render_scanline(uint8_t *screen, int line)
 {
-    if (!g_enabled) return;
+    if (!g_enabled || !screen)
+    {
+        GFX.render_sprites_only(line);
+        return;
+    }
     GFX.render_scanline(screen, line);
 }
@@ -1,3 +1,49 @@
+#include <assert.h>
+
+// Layers that can be hidden for debugging purposes
+enum
+{
+    GFX_LAYER_A        = 1<<0,
+    GFX_LAYER_B        = 1<<1,
+    GFX_LAYER_W        = 1<<2,
+    GFX_LAYER_SPRITES  = 1<<3,
+    GFX_LAYER_SHI      = 1<<4,   // shadow/highlight effect
+};
+
+// Patterns (32 bytes of VRAM each) modified since the renderer decoded
+// them, one bit per pattern. The VDP marks them whenever it writes VRAM.
+extern MACHINE_LOCAL uint32_t GFX_DIRTY_PATTERNS[0x800/32];
+
+// Mark the patterns in the range of VRAM bytes [start, end)
+static inline void gfx_vram_written(int start, int end)
+{
+    assert(end <= 0x10000);
+    for (int idx = start >> 5; idx < (end + 31) >> 5; ++idx)
+        GFX_DIRTY_PATTERNS[idx >> 5] |= 1u << (idx & 31);
+}
+
+// Set when the SAT cache is modified: the sprite list must be parsed again
+extern MACHINE_LOCAL bool GFX_DIRTY_SAT;
+
+// Set when CRAM is modified: the palette must be converted again
+extern MACHINE_LOCAL bool GFX_DIRTY_CRAM;
+
+// The decoded patterns and the sprite lines are allocated on the heap for
+// each machine, instead of in the thread-local storage of every thread.
+// gfx_alloc returns false if it's out of memory.
+bool gfx_alloc(void);
+void gfx_free(void);
+
+// Force all the patterns, the sprite list and the palette to be
+// decoded again (VDP memories were reloaded)
+void gfx_invalidate(void);
+
+// The VDP memories are about to be replaced by these ones (snapshot load):
+// invalidate only what differs from the current contents
+void gfx_invalidate_changes(const uint8_t *vram, const uint8_t *cram, const uint8_t *sat_cache);
 
 void gfx_enable(bool enable);
+void gfx_disable_layers(int mask);
+// Render a line into screen. With a NULL screen (or when disabled), only
+// the side effects of the line (sprite overflow/collision) are emulated.
 void gfx_render_scanline(uint8_t *screen, int line);
@@ -23,6 +23,8 @@ static clock_t fpsclock;
 static int fpscounter;
 static int g_audioenable;
 static int g_videoenable;
+static int g_headless;
+static uint8_t nokeys[512];
 
 #define WINDOW_WIDTH 900
 
@@ -60,6 +62,20 @@ void hw_init(int audiofreq, int fps)
         AUDIO_BUF[i] = calloc(samples_per_frame*2*2, 1);
 }
 
+// Initialize only the frame and audio buffers, without touching SDL:
+// no window, no audio device, and an always-released keyboard.
+// Used for benchmarks and other batch runs.
+void hw_init_headless(int audiofreq, int fps)
+{
+    g_headless = 1;
+    keystate = nokeys;
+
+    samples_per_frame = audiofreq / fps;
+
+    for (int i=0;i<HW_AUDIO_NUMBUFFERS;++i)
+        AUDIO_BUF[i] = calloc(samples_per_frame*2*2, 1);
+}
+
 int hw_poll(void)
 {
     SDL_Event event;
@@ -175,7 +191,6 @@ void hw_save_screenshot(const char *fn)
 
 void hw_beginaudio(int16_t **buf, int *nsamples)
 {
-    extern int framecounter;
 #if 1
     if (audio_buf_index_w >= audio_buf_index_r + HW_AUDIO_NUMBUFFERS)
         printf("[AUDIO](FC=%04d/R=%04d/W%04d) Warning: overflow audio buffer (producing too fast)\n", framecounter, audio_buf_index_r, audio_buf_index_w);
@@ -187,6 +202,10 @@ void hw_beginaudio(int16_t **buf, int *nsamples)
 void hw_endaudio(void)
 {
     audio_buf_index_w += 1;
+
+    // Nobody is consuming audio, so just drop it
+    if (g_headless)
+        audio_buf_index_r = audio_buf_index_w;
 }
 
 void fill_audio(void *userdata, uint8_t *stream, int len)
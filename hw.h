@@ -12,6 +12,7 @@ extern uint8_t keypressed[256];
 extern uint8_t keyreleased[256];
 
 void hw_init(int audiofreq, int fps);
+void hw_init_headless(int audiofreq, int fps);
 int hw_poll(void);
 
 void hw_enable_audio(int enable);
@@ -1,12 +1,16 @@
+#include <stdint.h>
 #include "mem.h"
-#include <SDL.h>
-extern "C" {
-        #include "hw.h"
-}
+#include "ioports.h"
+#include "trace.h"
 
-class IoPort
+// Currently pressed buttons for each pad, fed by the frontend
+static MACHINE_LOCAL uint8_t pad_buttons[2];
+
+// State of a port, as saved by ioports_save(). It's kept apart from the
+// port objects below, which are shared by all the threads and only hold
+// their (constant) wiring.
+struct ioport_state
 {
-private:
     uint8_t data;
     uint8_t ctrl;
 
@@ -14,53 +18,87 @@ private:
     uint8_t rxdata;
     uint8_t sctrl;
 
+    uint8_t th;         // TH line, for gamepads
+};
+
+static MACHINE_LOCAL ioport_state PORTS[3];
+
+class IoPort
+{
 protected:
+    ioport_state &state() { return PORTS[_idx]; }
+
     virtual uint8_t connected_lines() = 0;
     virtual void write_lines(uint8_t) = 0;
     virtual uint8_t read_lines() = 0;
 
+private:
+    int _idx;
+
 public:
+    IoPort(int idx): _idx(idx) {}
+
     void init(void)
     {
-        data = 0x7F;
-        ctrl = 0;
-        txdata = 0xFF;
-        rxdata = 0x00;
-        sctrl = 0;
+        ioport_state &s = state();
+        s.data = 0x7F;
+        s.ctrl = 0;
+        s.txdata = 0xFF;
+        s.rxdata = 0x00;
+        s.sctrl = 0;
+        s.th = 0;
+    }
+
+    void save(uint8_t *buf)
+    {
+        ioport_state &s = state();
+        buf[0] = s.data; buf[1] = s.ctrl;
+        buf[2] = s.txdata; buf[3] = s.rxdata; buf[4] = s.sctrl;
+        buf[5] = s.th;
+    }
+
+    void load(const uint8_t *buf)
+    {
+        ioport_state &s = state();
+        s.data = buf[0]; s.ctrl = buf[1];
+        s.txdata = buf[2]; s.rxdata = buf[3]; s.sctrl = buf[4];
+        s.th = buf[5];
     }
 
     void write_ctrl(uint8_t value)
     {
-        ctrl = value;
+        state().ctrl = value;
     }
     uint8_t read_ctrl()
     {
-        return ctrl;
+        return state().ctrl;
     }
 
     void write_data(uint8_t value)
     {
-        data = value;
-        write_lines(data & ctrl & connected_lines());
+        ioport_state &s = state();
+        s.data = value;
+        write_lines(s.data & s.ctrl & connected_lines());
     }
     uint8_t read_data()
     {
+        ioport_state &s = state();
+
         // Computer mask of bits marked as input
         // and currently connected to some external hardware
-        uint8_t mask = ~ctrl & connected_lines();
+        uint8_t mask = ~s.ctrl & connected_lines();
         uint8_t value = read_lines();
 
         // Unconnected bits and output bits simply returns the
         // any latched value.
-        return (value & mask) | (data & ~mask);
+        return (value & mask) | (s.data & ~mask);
     }
 };
 
 class Gamepad : public IoPort
 {
 private:
-    int _TH;
-    int _km;
+    int _pad;
 
 protected:
     uint8_t connected_lines()
@@ -70,43 +108,43 @@ protected:
 
     void write_lines(uint8_t value)
     {
-        _TH = BIT(value, 6);
+        state().th = BIT(value, 6);
     }
 
     uint8_t read_lines()
     {
-        if (_km > 0)
+        if (_pad >= 2)
             return 0xFF;
 
         uint8_t ret=0;
-        int *km = keymaps[_km];
+        uint8_t buttons = pad_buttons[_pad];
 
-        if (_TH)
+        if (state().th)
         {
-            if (keystate[km[0]])
+            if (buttons & PAD_UP)
                 ret |= (1 << 0);
-            if (keystate[km[1]])
+            if (buttons & PAD_DOWN)
                 ret |= (1 << 1);
-            if (keystate[km[2]])
+            if (buttons & PAD_LEFT)
                 ret |= (1 << 2);
-            if (keystate[km[3]])
+            if (buttons & PAD_RIGHT)
                 ret |= (1 << 3);
-            if (keystate[km[6]])
+            if (buttons & PAD_B)
                 ret |= (1 << 4);
-            if (keystate[km[7]])
+            if (buttons & PAD_C)
                 ret |= (1 << 5);
         }
         else
         {
-            if (keystate[km[0]])
+            if (buttons & PAD_UP)
                 ret |= (1 << 0);
-            if (keystate[km[1]])
+            if (buttons & PAD_DOWN)
                 ret |= (1 << 1);
             ret |= (1 << 2);
             ret |= (1 << 3);
-            if (keystate[km[5]])
+            if (buttons & PAD_A)
                 ret |= (1 << 4);
-            if (keystate[km[4]])
+            if (buttons & PAD_START)
                 ret |= (1 << 5);
         }
 
@@ -114,25 +152,47 @@ protected:
     }
 
 public:
-    static int keymaps[1][8];
-
-    Gamepad(int km): _km(km) {}
+    Gamepad(int pad): IoPort(pad), _pad(pad) {}
 };
 
-int Gamepad::keymaps[1][8] = {
-        { SDL_SCANCODE_UP, SDL_SCANCODE_DOWN, SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT, SDL_SCANCODE_RETURN, SDL_SCANCODE_Z, SDL_SCANCODE_X, SDL_SCANCODE_C }
-};
+static Gamepad PORT_A(0), PORT_B(1), PORT_C(2);
+
 
-Gamepad PORT_A(0), PORT_B(1), PORT_C(2);
+void ioports_set_pad(int pad, uint8_t buttons)
+{
+    if (pad >= 0 && pad < 2)
+        pad_buttons[pad] = buttons;
+}
 
+uint8_t ioports_get_pad(int pad)
+{
+    if (pad >= 0 && pad < 2)
+        return pad_buttons[pad];
+    return 0;
+}
 
 void ioports_init(void)
 {
+    pad_buttons[0] = pad_buttons[1] = 0;
     PORT_A.init();
     PORT_B.init();
     PORT_C.init();
 }
 
+void ioports_save(uint8_t *buf)
+{
+    PORT_A.save(buf);
+    PORT_B.save(buf + 6);
+    PORT_C.save(buf + 12);
+}
+
+void ioports_load(const uint8_t *buf)
+{
+    PORT_A.load(buf);
+    PORT_B.load(buf + 6);
+    PORT_C.load(buf + 12);
+}
+
 uint8_t ioports_read(unsigned int port)
 {
     port |= 1;
@@ -148,7 +208,7 @@ uint8_t ioports_read(unsigned int port)
     case 0xD:  return PORT_C.read_ctrl();
 
     default:
-        mem_log("IOPORTS", "Unhandled read8: %02x\n", port);
+        TRACE(TRACE_IOPORTS, "Unhandled read8: %02x\n", port);
         return 0xFF;
     }
 }
@@ -168,6 +228,6 @@ void ioports_write(unsigned int port, uint8_t value)
     case 0xD:  PORT_C.write_ctrl(value); return;
 
     default:
-        mem_log("IOPORTS", "Unhandled write8: %02x\n", port);
+        TRACE(TRACE_IOPORTS, "Unhandled write8: %02x\n", port);
     }
 }
@@ -1,4 +1,23 @@
+// Gamepad buttons, as passed to ioports_set_pad()
+enum
+{
+    PAD_UP     = 1<<0,
+    PAD_DOWN   = 1<<1,
+    PAD_LEFT   = 1<<2,
+    PAD_RIGHT  = 1<<3,
+    PAD_START  = 1<<4,
+    PAD_A      = 1<<5,
+    PAD_B      = 1<<6,
+    PAD_C      = 1<<7,
+};
+
+// Size of the ports state saved by ioports_save()
+#define IOPORTS_STATE_SIZE  18
 
 void ioports_init(void);
+void ioports_save(uint8_t *buf);
+void ioports_load(const uint8_t *buf);
 uint8_t ioports_read(unsigned int port);
 void ioports_write(unsigned int port, uint8_t value);
+void ioports_set_pad(int pad, uint8_t buttons);
+uint8_t ioports_get_pad(int pad);
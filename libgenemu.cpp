@@ -0,0 +1,136 @@
+#include "libgenemu.h"
+#include "machine.h"
+#include "vdp.h"
+#include "gfx.h"
+#include "mem.h"
+#include "ioports.h"
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+struct genemu
+{
+    Machine machine;
+    uint8_t framebuf[GENEMU_SCREEN_WIDTH*GENEMU_SCREEN_HEIGHT*4];
+    int16_t audio[(YM2612_FREQ/50 + 1) * 2];
+    int nsamples;
+    bool loaded;
+};
+
+genemu_t *genemu_create(void)
+{
+    if (Machine::current())
+        return NULL;
+
+    genemu_t *emu = (genemu_t*)calloc(1, sizeof(genemu_t));
+    if (!emu)
+        return NULL;
+
+    new (&emu->machine) Machine();
+    if (!emu->machine.allocated())
+    {
+        emu->machine.~Machine();
+        free(emu);
+        return NULL;
+    }
+    gfx_enable(true);
+    return emu;
+}
+
+// The console state is thread-local: a handle used from another thread
+// would act on the state of that thread (if any), so it's ignored.
+static bool is_current(genemu_t *emu)
+{
+    return &emu->machine == Machine::current();
+}
+
+void genemu_destroy(genemu_t *emu)
+{
+    if (!emu || !is_current(emu))
+        return;
+    emu->machine.~Machine();
+    free(emu);
+}
+
+int genemu_load_rom(genemu_t *emu, const char *filename)
+{
+    if (!is_current(emu))
+        return -1;
+    if (!emu->machine.load_rom(filename))
+        return -1;
+    emu->loaded = true;
+    return 0;
+}
+
+int genemu_load_sram(genemu_t *emu, const char *filename)
+{
+    if (!is_current(emu))
+        return -1;
+    return emu->machine.load_sram(filename) ? 0 : -1;
+}
+
+void genemu_set_pal(genemu_t *emu, int pal)
+{
+    if (!is_current(emu))
+        return;
+    emu->machine.set_pal(pal != 0);
+}
+
+int genemu_get_pal(genemu_t *emu)
+{
+    if (!is_current(emu))
+        return -1;
+    return emu->machine.pal();
+}
+
+void genemu_reset(genemu_t *emu)
+{
+    if (!is_current(emu))
+        return;
+    emu->machine.reset();
+}
+
+void genemu_step_frame(genemu_t *emu)
+{
+    if (!emu->loaded || !is_current(emu))
+        return;
+
+    emu->nsamples = YM2612_FREQ / (emu->machine.pal() ? 50 : 60);
+    emu->machine.run_frame(emu->framebuf, GENEMU_SCREEN_WIDTH*4, emu->audio, emu->nsamples);
+}
+
+void genemu_skip_frame(genemu_t *emu)
+{
+    if (!emu->loaded || !is_current(emu))
+        return;
+
+    emu->nsamples = YM2612_FREQ / (emu->machine.pal() ? 50 : 60);
+    emu->machine.run_frame(NULL, 0, emu->audio, emu->nsamples);
+}
+
+void genemu_set_input(genemu_t *emu, int pad, unsigned int buttons)
+{
+    if (!is_current(emu))
+        return;
+    ioports_set_pad(pad, buttons);
+}
+
+const uint8_t *genemu_get_framebuffer(genemu_t *emu, int *pitch)
+{
+    if (pitch)
+        *pitch = GENEMU_SCREEN_WIDTH*4;
+    return emu->framebuf;
+}
+
+const int16_t *genemu_get_audio(genemu_t *emu, int *nsamples)
+{
+    if (nsamples)
+        *nsamples = emu->nsamples;
+    return emu->audio;
+}
+
+// Same for all the instances
+int genemu_get_audio_freq(genemu_t *)
+{
+    return YM2612_FREQ;
+}
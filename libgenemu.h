@@ -0,0 +1,81 @@
+#ifndef __LIBGENEMU_H__
+#define __LIBGENEMU_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C API to the emulation core. It doesn't depend on SDL or any
+ * other display/audio stack: the host is in charge of presenting
+ * the framebuffer, playing the audio and providing input.
+ *
+ * The emulation state is thread-local, which has two consequences:
+ *  - an instance can't move between threads: it must only be used
+ *    (including genemu_destroy()) from the thread that created it;
+ *    called from another thread, the functions that return an int
+ *    return -1, and the others do nothing;
+ *  - a thread can't host two instances: genemu_create() returns NULL
+ *    if the calling thread already has one.
+ * Run instances on separate threads to emulate many consoles at once.
+ * The large memories (RAM, VRAM, renderer caches) are allocated by
+ * genemu_create(), so linking the library only costs about 25 KB of
+ * thread-local storage to every thread of the process.
+ */
+typedef struct genemu genemu_t;
+
+/* Pad buttons for genemu_set_input() */
+#define GENEMU_BUTTON_UP     (1<<0)
+#define GENEMU_BUTTON_DOWN   (1<<1)
+#define GENEMU_BUTTON_LEFT   (1<<2)
+#define GENEMU_BUTTON_RIGHT  (1<<3)
+#define GENEMU_BUTTON_START  (1<<4)
+#define GENEMU_BUTTON_A      (1<<5)
+#define GENEMU_BUTTON_B      (1<<6)
+#define GENEMU_BUTTON_C      (1<<7)
+
+/* Framebuffer geometry; pixels are 4 bytes: R, G, B, unused */
+#define GENEMU_SCREEN_WIDTH   320
+#define GENEMU_SCREEN_HEIGHT  240
+
+genemu_t *genemu_create(void);
+void genemu_destroy(genemu_t *emu);
+
+/* Load a .bin or .smd ROM and power on the console. Returns 0 on success. */
+int genemu_load_rom(genemu_t *emu, const char *filename);
+
+/* Keep the battery-backed RAM of the loaded cartridge (if any) in the
+   specified file, created if missing. Returns 0 on success. */
+int genemu_load_sram(genemu_t *emu, const char *filename);
+
+/* Override the region autodetected from the ROM header */
+void genemu_set_pal(genemu_t *emu, int pal);
+int genemu_get_pal(genemu_t *emu);
+
+void genemu_reset(genemu_t *emu);
+
+/* Emulate a whole frame (262 lines in NTSC, 313 in PAL) */
+void genemu_step_frame(genemu_t *emu);
+
+/* Emulate a whole frame without composing the framebuffer, which keeps
+   the previous frame. Much faster, to fast-forward. */
+void genemu_skip_frame(genemu_t *emu);
+
+/* Set currently pressed buttons (GENEMU_BUTTON_*) for pad 0 or 1 */
+void genemu_set_input(genemu_t *emu, int pad, unsigned int buttons);
+
+/* Framebuffer of the last emulated frame */
+const uint8_t *genemu_get_framebuffer(genemu_t *emu, int *pitch);
+
+/* Audio of the last emulated frame: interleaved stereo samples at
+ * genemu_get_audio_freq() Hz; nsamples receives the number of frames. */
+const int16_t *genemu_get_audio(genemu_t *emu, int *nsamples);
+int genemu_get_audio_freq(genemu_t *emu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
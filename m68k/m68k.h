@@ -165,6 +165,16 @@ unsigned int  m68k_read_memory_32(unsigned int address);
 unsigned int  m68k_read_immediate_16(unsigned int address);
 unsigned int  m68k_read_immediate_32(unsigned int address);
 
+/* Host pointer to the 64KB page of code containing address, or NULL
+ * (only with M68K_FETCH_CACHE)
+ */
+const unsigned char *m68k_fetch_page(unsigned int address);
+
+/* Called when a backward branch is taken
+ * (only with M68K_BACKWARD_BRANCH_HOOK)
+ */
+void m68k_backward_branch(void);
+
 /* Read data relative to the PC */
 unsigned int  m68k_read_pcrelative_8(unsigned int address);
 unsigned int  m68k_read_pcrelative_16(unsigned int address);
@@ -320,6 +330,11 @@ unsigned int m68k_get_context(void* dst);
 /* set the current cpu context */
 void m68k_set_context(void* dst);
 
+/* Drop the cached code page (see M68K_FETCH_CACHE); call it when the
+ * memory map changes.
+ */
+void m68k_fetch_invalidate(void);
+
 /* Register the CPU state information */
 void m68k_state_register(const char *type);
 
@@ -139,6 +139,25 @@
 #define M68K_EMULATE_PREFETCH       OPT_OFF
 
 
+/* If ON, instructions are fetched directly from host memory: the callback
+ * returns a pointer to the 64KB page containing the given address (or NULL
+ * if the page isn't plain memory, in which case fetches go through
+ * m68k_read_immediate_xx()), and it's cached until the PC leaves the page.
+ * The host must call m68k_fetch_invalidate() whenever its memory map
+ * changes. Not compatible with M68K_EMULATE_PREFETCH.
+ */
+#define M68K_FETCH_CACHE            OPT_ON
+#define M68K_FETCH_PAGE_CALLBACK(A) m68k_fetch_page(A)
+
+
+/* If ON, the CPU will call the handler every time it takes a backward
+ * 8 or 16-bit branch (Bcc, BRA, DBcc), after the PC has been updated and
+ * before the cycles of the branch are used; eg: to detect idle loops.
+ */
+#define M68K_BACKWARD_BRANCH_HOOK       OPT_ON
+#define M68K_BACKWARD_BRANCH_CALLBACK() m68k_backward_branch()
+
+
 /* If ON, the CPU will generate address error exceptions if it tries to
  * access a word or longword at an odd address.
  * NOTE: This is only emulated properly for 68000 mode.
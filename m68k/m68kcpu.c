@@ -40,15 +40,16 @@
 
 #include "m68kops.h"
 #include "m68kcpu.h"
+#include <string.h>
 
 /* ======================================================================== */
 /* ================================= DATA ================================= */
 /* ======================================================================== */
 
-int  m68ki_initial_cycles;
-int  m68ki_remaining_cycles = 0;                     /* Number of clocks remaining */
-uint m68ki_tracing = 0;
-uint m68ki_address_space;
+MACHINE_LOCAL int  m68ki_initial_cycles;
+MACHINE_LOCAL int  m68ki_remaining_cycles = 0;                     /* Number of clocks remaining */
+MACHINE_LOCAL uint m68ki_tracing = 0;
+MACHINE_LOCAL uint m68ki_address_space;
 
 #ifdef M68K_LOG_ENABLE
 char* m68ki_cpu_names[9] =
@@ -66,15 +67,21 @@ char* m68ki_cpu_names[9] =
 #endif /* M68K_LOG_ENABLE */
 
 /* The CPU core */
-m68ki_cpu_core m68ki_cpu = {0};
+MACHINE_LOCAL m68ki_cpu_core m68ki_cpu = {0};
 
 #if M68K_EMULATE_ADDRESS_ERROR
-jmp_buf m68ki_aerr_trap;
+MACHINE_LOCAL jmp_buf m68ki_aerr_trap;
 #endif /* M68K_EMULATE_ADDRESS_ERROR */
 
-uint    m68ki_aerr_address;
-uint    m68ki_aerr_write_mode;
-uint    m68ki_aerr_fc;
+MACHINE_LOCAL uint    m68ki_aerr_address;
+MACHINE_LOCAL uint    m68ki_aerr_write_mode;
+MACHINE_LOCAL uint    m68ki_aerr_fc;
+
+#if M68K_FETCH_CACHE
+/* Code page cache (see m68ki_fetch_ptr) */
+MACHINE_LOCAL const uint8 *m68ki_fetch_mem;
+MACHINE_LOCAL uint    m68ki_fetch_page = ~0;
+#endif /* M68K_FETCH_CACHE */
 
 /* Used by shift & rotate instructions */
 uint8 m68ki_shift_8_table[65] =
@@ -370,7 +377,7 @@ uint8 m68ki_ea_idx_cycle_table[64] =
  */
 
 /* Interrupt acknowledge */
-static int default_int_ack_callback_data;
+static MACHINE_LOCAL int default_int_ack_callback_data;
 static int default_int_ack_callback(int int_level)
 {
 	default_int_ack_callback_data = int_level;
@@ -379,7 +386,7 @@ static int default_int_ack_callback(int int_level)
 }
 
 /* Breakpoint acknowledge */
-static unsigned int default_bkpt_ack_callback_data;
+static MACHINE_LOCAL unsigned int default_bkpt_ack_callback_data;
 static void default_bkpt_ack_callback(unsigned int data)
 {
 	default_bkpt_ack_callback_data = data;
@@ -391,14 +398,14 @@ static void default_reset_instr_callback(void)
 }
 
 /* Called when the program counter changed by a large value */
-static unsigned int default_pc_changed_callback_data;
+static MACHINE_LOCAL unsigned int default_pc_changed_callback_data;
 static void default_pc_changed_callback(unsigned int new_pc)
 {
 	default_pc_changed_callback_data = new_pc;
 }
 
 /* Called every time there's bus activity (read/write to/from memory */
-static unsigned int default_set_fc_callback_data;
+static MACHINE_LOCAL unsigned int default_set_fc_callback_data;
 static void default_set_fc_callback(unsigned int new_fc)
 {
 	default_set_fc_callback_data = new_fc;
@@ -749,6 +756,10 @@ void m68k_init(void)
 		emulation_initialized = 1;
 	}
 
+	/* Start from a clean context (registers are not cleared by a reset) */
+	memset(&m68ki_cpu, 0, sizeof(m68ki_cpu));
+	m68k_fetch_invalidate();
+
 	m68k_set_int_ack_callback(NULL);
 	m68k_set_bkpt_ack_callback(NULL);
 	m68k_set_reset_instr_callback(NULL);
@@ -814,6 +825,15 @@ unsigned int m68k_get_context(void* dst)
 void m68k_set_context(void* src)
 {
 	if(src) m68ki_cpu = *(m68ki_cpu_core*)src;
+	m68k_fetch_invalidate();
+}
+
+void m68k_fetch_invalidate(void)
+{
+#if M68K_FETCH_CACHE
+	m68ki_fetch_page = ~0;
+	m68ki_fetch_mem = NULL;
+#endif /* M68K_FETCH_CACHE */
 }
 
 
@@ -34,6 +34,7 @@
 #define M68KCPU__HEADER
 
 #include "m68k.h"
+#include "../machine.h"
 #include <limits.h>
 
 #if M68K_EMULATE_ADDRESS_ERROR
@@ -470,6 +471,12 @@
 	#define m68ki_pc_changed(A)
 #endif /* M68K_MONITOR_PC */
 
+#if M68K_BACKWARD_BRANCH_HOOK
+	#define m68ki_backward_branch_hook(OFFSET) if((sint)(OFFSET) < 0) M68K_BACKWARD_BRANCH_CALLBACK()
+#else
+	#define m68ki_backward_branch_hook(OFFSET)
+#endif /* M68K_BACKWARD_BRANCH_HOOK */
+
 
 /* Enable or disable function code emulation */
 #if M68K_EMULATE_FC
@@ -511,7 +518,7 @@
 /* Address error */
 #if M68K_EMULATE_ADDRESS_ERROR
 	#include <setjmp.h>
-	extern jmp_buf m68ki_aerr_trap;
+	extern MACHINE_LOCAL jmp_buf m68ki_aerr_trap;
 
 	#define m68ki_set_address_error_trap() \
 		if(setjmp(m68ki_aerr_trap) != 0) \
@@ -848,19 +855,24 @@ typedef struct
 } m68ki_cpu_core;
 
 
-extern m68ki_cpu_core m68ki_cpu;
-extern sint           m68ki_remaining_cycles;
-extern uint           m68ki_tracing;
+extern MACHINE_LOCAL m68ki_cpu_core m68ki_cpu;
+extern MACHINE_LOCAL sint  m68ki_remaining_cycles;
+extern MACHINE_LOCAL uint  m68ki_tracing;
 extern uint8          m68ki_shift_8_table[];
 extern uint16         m68ki_shift_16_table[];
 extern uint           m68ki_shift_32_table[];
 extern uint8          m68ki_exception_cycle_table[][256];
-extern uint           m68ki_address_space;
+extern MACHINE_LOCAL uint  m68ki_address_space;
 extern uint8          m68ki_ea_idx_cycle_table[];
 
-extern uint           m68ki_aerr_address;
-extern uint           m68ki_aerr_write_mode;
-extern uint           m68ki_aerr_fc;
+extern MACHINE_LOCAL uint  m68ki_aerr_address;
+extern MACHINE_LOCAL uint  m68ki_aerr_write_mode;
+extern MACHINE_LOCAL uint  m68ki_aerr_fc;
+
+#if M68K_FETCH_CACHE
+extern MACHINE_LOCAL const uint8 *m68ki_fetch_mem;
+extern MACHINE_LOCAL uint  m68ki_fetch_page;
+#endif /* M68K_FETCH_CACHE */
 
 /* Read data immediately after the program counter */
 INLINE uint m68ki_read_imm_16(void);
@@ -992,6 +1004,21 @@ char* m68ki_disassemble_quick(unsigned int pc, unsigned int cpu_type);
 /* Handles all immediate reads, does address error check, function code setting,
  * and prefetching if they are enabled in m68kconf.h
  */
+#if M68K_FETCH_CACHE
+/* Host memory for the code at address, or NULL if it must go through the
+ * memory handlers
+ */
+INLINE const uint8* m68ki_fetch_ptr(uint address)
+{
+	if((address >> 16) != m68ki_fetch_page)
+	{
+		m68ki_fetch_page = address >> 16;
+		m68ki_fetch_mem = M68K_FETCH_PAGE_CALLBACK(address);
+	}
+	return m68ki_fetch_mem ? m68ki_fetch_mem + (address & 0xffff) : NULL;
+}
+#endif /* M68K_FETCH_CACHE */
+
 INLINE uint m68ki_read_imm_16(void)
 {
 	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
@@ -1004,6 +1031,14 @@ INLINE uint m68ki_read_imm_16(void)
 	}
 	REG_PC += 2;
 	return MASK_OUT_ABOVE_16(CPU_PREF_DATA >> ((2-((REG_PC-2)&2))<<3));
+#elif M68K_FETCH_CACHE
+	{
+		const uint8* mem = m68ki_fetch_ptr(ADDRESS_68K(REG_PC));
+		REG_PC += 2;
+		if(mem)
+			return (mem[0] << 8) | mem[1];
+	}
+	return m68k_read_immediate_16(ADDRESS_68K(REG_PC-2));
 #else
 	REG_PC += 2;
 	return m68k_read_immediate_16(ADDRESS_68K(REG_PC-2));
@@ -1035,6 +1070,17 @@ INLINE uint m68ki_read_imm_32(void)
 #else
 	m68ki_set_fc(FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
 	m68ki_check_address_error(REG_PC, MODE_READ, FLAG_S | FUNCTION_CODE_USER_PROGRAM); /* auto-disable (see m68kcpu.h) */
+#if M68K_FETCH_CACHE
+	/* The slow path also handles the longwords that cross a page */
+	if((REG_PC & 0xffff) <= 0xfffc)
+	{
+		const uint8* mem = m68ki_fetch_ptr(ADDRESS_68K(REG_PC));
+		REG_PC += 4;
+		if(mem)
+			return ((uint)mem[0] << 24) | (mem[1] << 16) | (mem[2] << 8) | mem[3];
+		return m68k_read_immediate_32(ADDRESS_68K(REG_PC-4));
+	}
+#endif /* M68K_FETCH_CACHE */
 	REG_PC += 4;
 	return m68k_read_immediate_32(ADDRESS_68K(REG_PC-4));
 #endif /* M68K_EMULATE_PREFETCH */
@@ -1360,11 +1406,13 @@ INLINE void m68ki_jump_vector(uint vector)
 INLINE void m68ki_branch_8(uint offset)
 {
 	REG_PC += MAKE_INT_8(offset);
+	m68ki_backward_branch_hook(MAKE_INT_8(offset));
 }
 
 INLINE void m68ki_branch_16(uint offset)
 {
 	REG_PC += MAKE_INT_16(offset);
+	m68ki_backward_branch_hook(MAKE_INT_16(offset));
 }
 
 INLINE void m68ki_branch_32(uint offset)
@@ -0,0 +1,134 @@
+#include "machine.h"
+#include "vdp.h"
+#include "gfx.h"
+#include "cpu.h"
+#include "mem.h"
+#include "ioports.h"
+#include "sched.h"
+#include "rewind.h"
+#include "movie.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <mutex>
+extern "C" {
+    #include "ym2612/ym2612.h"
+}
+
+extern MACHINE_LOCAL int framecounter;
+extern MACHINE_LOCAL int VERSION_PAL;
+
+static MACHINE_LOCAL Machine *g_machine;
+static std::once_flag g_global_init;
+
+// Tables shared by all the machines (Musashi opcode handlers, YM2612
+// envelope/sine tables); they are built by the first call to the init
+// functions, so make sure that doesn't race between threads.
+static void global_init(void)
+{
+    m68k_init();
+    YM2612Init();
+}
+
+Machine::Machine()
+    : _romsize(0)
+{
+    assert(!g_machine);
+    std::call_once(g_global_init, global_init);
+    g_machine = this;
+
+    // The large memories live on the heap rather than in the static TLS
+    // (all of them are allocated, the destructor frees what succeeded)
+    bool ok = mem_alloc();
+    ok = VDP.alloc() && ok;
+    ok = gfx_alloc() && ok;
+    _allocated = ok;
+}
+
+Machine::~Machine()
+{
+    rewind_free();
+    movie_stop();
+    trace_disable();
+    mem_sram_close();
+    mem_free_rom();
+    gfx_free();
+    VDP.release();
+    mem_free();
+    g_machine = NULL;
+}
+
+Machine *Machine::current()
+{
+    return g_machine;
+}
+
+bool Machine::load_rom(const char *filename)
+{
+    int romsize;
+
+    if (!_allocated)
+        return false;
+
+    if (strstr(filename, ".smd"))
+        romsize = load_smd(filename);
+    else
+        romsize = load_bin(filename);
+    if (romsize <= 0)
+        return false;
+
+    // The history of the previous ROM is meaningless now
+    rewind_free();
+    movie_stop();
+
+    _romsize = romsize;
+    mem_init(romsize);
+    reset();
+    return true;
+}
+
+bool Machine::load_sram(const char *filename)
+{
+    return mem_sram_open(filename);
+}
+
+void Machine::reset()
+{
+    CPU_M68K.init();
+    CPU_Z80.init();
+    ioports_init();
+
+    MASTER_CLOCK = 0;
+    framecounter = 0;
+    CPU_M68K.reset();
+    VDP.init();
+}
+
+void Machine::run_frame(uint8_t *screen, int pitch, int16_t *audio, int nsamples)
+{
+    sched_run_frame(screen, pitch, audio, nsamples);
+    mem_sram_flush();
+    ++framecounter;
+}
+
+void Machine::run_frame_speculative(uint8_t *screen, int pitch, int16_t *audio, int nsamples)
+{
+    sched_run_frame(screen, pitch, audio, nsamples);
+    ++framecounter;
+}
+
+int Machine::frame()
+{
+    return framecounter;
+}
+
+void Machine::set_pal(bool pal)
+{
+    VERSION_PAL = pal ? 1 : 0;
+}
+
+bool Machine::pal()
+{
+    return VERSION_PAL != 0;
+}
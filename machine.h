@@ -0,0 +1,86 @@
+#ifndef __MACHINE_H__
+#define __MACHINE_H__
+
+/*
+ * All the mutable state of the emulated console (CPUs, VDP, YM2612,
+ * memory map, scheduler) is declared MACHINE_LOCAL, which makes it
+ * thread-local: every thread of the process hosts its own independent
+ * console, and the emulation code keeps accessing its state directly
+ * without an extra indirection in the hot paths. Since every thread
+ * pays for it, the large arrays are only pointers here, allocated on
+ * the heap when a Machine is created (mem_alloc, gfx_alloc, ...).
+ *
+ * The initial-exec model keeps the accesses direct also when the core is
+ * built as a shared library (the default model would call __tls_get_addr
+ * on each of them). It takes the state from the static TLS block of the
+ * process, which is why that state must stay small.
+ *
+ * This header is also included by the C cores (Musashi, YM2612).
+ */
+#define MACHINE_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+#ifdef __cplusplus
+
+#include <stdint.h>
+
+/*
+ * A console instance. It owns the state of the thread it has been created
+ * on, so there can be at most one Machine per thread, and it must only be
+ * used from that thread. Any number of threads can run a Machine at the
+ * same time.
+ */
+class Machine
+{
+public:
+    Machine();
+    ~Machine();
+
+    // False if the memories of the console couldn't be allocated: the
+    // machine can only be destroyed (load_rom fails).
+    bool allocated() { return _allocated; }
+
+    // Load a .bin or .smd ROM, map it and power on the console.
+    bool load_rom(const char *filename);
+
+    // Keep the battery-backed RAM of the cartridge (if it has one) in the
+    // specified file, which is created if missing. It is written back at
+    // the end of the frames that modified it, and when the machine is
+    // destroyed or another ROM is loaded. Snapshots include the backup
+    // RAM: loading one (or rewinding) overwrites the saves in the file.
+    bool load_sram(const char *filename);
+
+    // Power-on reset: clears the CPUs and the VDP and restarts from frame 0.
+    void reset();
+
+    // Emulate a single frame. The framebuffer is 320x240 pixels of 4 bytes;
+    // it can be NULL to skip the frame (no composition, but all the side
+    // effects visible to the game are still emulated). Audio is nsamples
+    // interleaved stereo samples at YM2612_FREQ (it can be NULL to skip
+    // audio rendering).
+    void run_frame(uint8_t *screen, int pitch, int16_t *audio, int nsamples);
+
+    // Same as run_frame, for a frame that will be undone by loading a
+    // snapshot (run-ahead): the backup RAM is not written back to its file.
+    void run_frame_speculative(uint8_t *screen, int pitch, int16_t *audio, int nsamples);
+
+    int frame();
+    int romsize() { return _romsize; }
+
+    // Region; it's autodetected from the ROM header by load_rom()
+    void set_pal(bool pal);
+    bool pal();
+
+    // Machine hosted by the calling thread, if any
+    static Machine *current();
+
+private:
+    Machine(const Machine&);
+    Machine& operator=(const Machine&);
+
+    int _romsize;
+    bool _allocated;
+};
+
+#endif
+
+#endif
@@ -4,40 +4,91 @@
 #include <assert.h>
 #include <stdint.h>
 #include <memory.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 extern "C" {
     #include "ym2612/ym2612.h"
 }
 #include "vdp.h"
 #include "cpu.h"
 #include "ioports.h"
+#include "sched.h"
+#include "trace.h"
+
+MACHINE_LOCAL uint8_t *ROM;
+static MACHINE_LOCAL size_t ROM_MAPPED;     // size of the mapping, 0 if malloc'd
+MACHINE_LOCAL uint8_t *RAM;                 // RAM_SIZE, see mem_alloc
+MACHINE_LOCAL uint8_t ZRAM[0x2000];
+MACHINE_LOCAL int Z80_BANK;
+extern MACHINE_LOCAL int activecpu;
+MACHINE_LOCAL int VERSION_OVERSEA;
+MACHINE_LOCAL int VERSION_PAL;
+
+// The 68000 address space is split into 256 pages of 64KB, with separate
+// tables for reads and writes, so that ROM is simply a page that has host
+// memory for reads and a handler for writes. The Z80 has 16 pages of 4KB,
+// mapped the same way.
+MACHINE_LOCAL mempage m68k_rtable[256];
+MACHINE_LOCAL mempage m68k_wtable[256];
+MACHINE_LOCAL mempage z80_rtable[16];
+MACHINE_LOCAL mempage z80_wtable[16];
+
+#if MEM_HEATMAP
+// Accesses per page, split between host memory and handlers
+struct memheat {
+    uint64_t mem_r, mem_w;
+    uint64_t io_r, io_w;
+};
+static MACHINE_LOCAL memheat m68k_heat[256];
+static MACHINE_LOCAL memheat z80_heat[16];
+#define HEAT(table, page, field)   (table[page].field++)
+#else
+#define HEAT(table, page, field)   do {} while(0)
+#endif
 
-uint8_t *ROM;
-uint8_t RAM[0x10000];
-uint8_t ZRAM[0x2000];
-int Z80_BANK;
-extern int activecpu;
-int VERSION_OVERSEA;
-int VERSION_PAL;
-
-inline uint16_t SWAP16(uint16_t a) {
-    return (a >> 8) | (a << 8);
-}
+MACHINE_LOCAL uint32_t mem_idle_epoch;
+MACHINE_LOCAL uint64_t mem_idle_horizon;
 
-void *m68k_memtable[256];
-void *z80_memtable[16];
-typedef unsigned int (*memfunc_r)(unsigned int address);
-typedef void         (*memfunc_w)(unsigned int address, unsigned int value);
+void mem_z80area(bool active);
+static void cartidge_w8(unsigned int address, unsigned int value);
 
-struct memfunc_pair {
-    memfunc_r read8, read16;
-    memfunc_w write8, write16;
-};
+/********************************************
+ * Unmapped areas
+ ********************************************/
 
-#define MEMFUN_READONLY(x)     ((void*)((unsigned long)(x) | 2))
-#define MEMFUN_PAIR(x)         ((void*)((unsigned long)(x) | 1))
-#define GET_MEMFUNC_PAIR(x)    ((memfunc_pair*)((unsigned long)(x) & ~1))
+static unsigned int unmapped_mem_r8(unsigned int address)
+{
+    mem_err("MEM", "unknown read8 at %06x\n", address);
+    return 0xFF;
+}
+static unsigned int unmapped_mem_r16(unsigned int address)
+{
+    mem_err("MEM", "unknown read16 at %06x\n", address);
+    return 0xFFFF;
+}
+static void unmapped_mem_w8(unsigned int address, unsigned int value)
+{
+    mem_err("MEM", "unknown write8 at %06x: %02x\n", address, value);
+}
+static void unmapped_mem_w16(unsigned int address, unsigned int value)
+{
+    mem_err("MEM", "unknown write16 at %06x: %04x\n", address, value);
+}
 
-void mem_z80area(bool active);
+static void rom_mem_w8(unsigned int address, unsigned int value)
+{
+    mem_err("MEM", "Writing to ROM: %06x <- %02x\n", address, value);
+}
+static void rom_mem_w16(unsigned int address, unsigned int value)
+{
+    mem_err("MEM", "Writing to ROM: %06x <- %04x\n", address, value);
+}
 
 /********************************************
  * Z80 area access from m68k
@@ -46,7 +97,7 @@ void mem_z80area(bool active);
 static unsigned int z80area_mem_r16(unsigned int address)
 {
     address &= 0x7FFF;
-    assert(!"68000 word read from z80 area");
+    mem_err("MEM", "68000 word read from z80 area %04x\n", address);
     unsigned int value = RdZ80(address);
     return (value << 8) | value;
 }
@@ -158,6 +209,7 @@ static void io_mem_w8(unsigned int address, unsigned int value)
         CPU_Z80.sync();
         CPU_Z80.set_busreq_line(value & 1);
         mem_z80area(value & 1);
+        sched_z80_changed();
         return;
     }
 
@@ -165,16 +217,18 @@ static void io_mem_w8(unsigned int address, unsigned int value)
     {
         assert(activecpu == 0);
         CPU_Z80.sync();
-        if (CPU_Z80.set_reset_line(~value & 1))
-        {
-            FILE *f = fopen("z80.dmp", "w");
-            fwrite(ZRAM, 1, sizeof(ZRAM), f);
-            fclose(f);
-        }
+        CPU_Z80.set_reset_line(~value & 1);     // traced as TRACE_Z80
+        sched_z80_changed();
         // DO NOT reset YM2612 here (confirmed batman&robin)
         return;
     }
 
+    if ((address & ~0xF) == 0x30F0)
+    {
+        cartidge_w8(address, value);
+        return;
+    }
+
     mem_err("MEM", "write8 to I/O area %04x: %04x\n", address, value);
 }
 static void io_mem_w16(unsigned int address, unsigned int value)
@@ -182,7 +236,7 @@ static void io_mem_w16(unsigned int address, unsigned int value)
     address &= 0xFFFF;
     if (address < 0x20)
     {
-        mem_log("MEM", "write16 to I/O area %04x: %04x\n", address, value);
+        TRACE(TRACE_MEM, "write16 to I/O area %04x: %04x\n", address, value);
         return;
     }
 
@@ -192,6 +246,13 @@ static void io_mem_w16(unsigned int address, unsigned int value)
         return;
     }
 
+    // Cartridge registers are on the low byte
+    if ((address & ~0xF) == 0x30F0)
+    {
+        cartidge_w8(address | 1, value & 0xFF);
+        return;
+    }
+
     exp_mem_w16(address, value);
 }
 
@@ -211,7 +272,8 @@ void zbankreg_mem_w8(unsigned int address, unsigned int value)
     {
         Z80_BANK >>= 1;
         Z80_BANK |= (value & 1) << 8;
-        // mem_log("Z80", "bank points to: %06x\n", Z80_BANK << 15);
+        // TRACE(TRACE_Z80, "bank points to: %06x\n", Z80_BANK << 15);
+        mem_z80bank_update();
         return;
     }
 }
@@ -221,7 +283,7 @@ unsigned int zbank_mem_r8(unsigned int address)
     address &= 0x7FFF;
     address |= (Z80_BANK << 15);
 
-    // mem_log("Z80", "bank read: %06x\n", address);
+    // TRACE(TRACE_Z80, "bank read: %06x\n", address);
     return m68k_read_memory_8(address);
 }
 void zbank_mem_w8(unsigned int address, unsigned int value)
@@ -229,7 +291,7 @@ void zbank_mem_w8(unsigned int address, unsigned int value)
     address &= 0x7FFF;
     address |= (Z80_BANK << 15);
 
-    // mem_log("Z80", "bank write %06x: %02x\n", address, value);
+    // TRACE(TRACE_Z80, "bank write %06x: %02x\n", address, value);
     m68k_write_memory_8(address, value);
 }
 
@@ -252,12 +314,15 @@ void zvdp_mem_w8(unsigned int address, unsigned int value)
 
 unsigned int ym2612_mem_r8(unsigned int address)
 {
+    // Bring timers up to date before reading the status
+    sched_audio_sync(sched_clock());
     return YM2612Read();
 }
 void ym2612_mem_w8(unsigned int address, unsigned int value)
 {
+    sched_audio_sync(sched_clock());
     address &= 0x3;
-    //mem_log("YM2612", "reg write %d: %02x\n", address, value);
+    //TRACE(TRACE_YM2612, "reg write %d: %02x\n", address, value);
     YM2612Write(address, value);
 }
 
@@ -267,59 +332,44 @@ void ym2612_mem_w8(unsigned int address, unsigned int value)
  ********************************************/
 
 template<class TYPE>
-unsigned int m68k_read_memory(unsigned int address)
+static inline unsigned int m68k_read_memory(unsigned int address)
 {
-    if ((address >> 16) >= 256)
-    {
-        mem_err("MEM", "invalid memory access: %x\n", address);
-        assert(0);
-    }
-    unsigned long t = (unsigned long)m68k_memtable[address >> 16];
-    if (t) {
-        if (!(t & 1)) {
-            t = (t & ~3) + (address & 0xFFFF);
-            if (sizeof(TYPE) == 2)
-                return SWAP16(*(uint16_t*)t);
-            else
-                return *(uint8_t*)t;
-        }
+    // Musashi masks addresses to 24 bits
+    const mempage &page = m68k_rtable[(address >> 16) & 0xFF];
+    if (page.mem) {
+        HEAT(m68k_heat, (address >> 16) & 0xFF, mem_r);
+        const uint8_t *mem = page.mem + (address & 0xFFFF);
         if (sizeof(TYPE) == 2)
-            return GET_MEMFUNC_PAIR(t)->read16(address);
-        return GET_MEMFUNC_PAIR(t)->read8(address);
+            return FETCH16(mem);
+        return *mem;
     }
-    mem_err("MEM", "unknown read%ld at %06x\n", sizeof(TYPE)*8, address);
-    assert(0);
-    return 0xFFFFFFFF & ((1L<<(sizeof(TYPE)*8)) - 1);
+    HEAT(m68k_heat, (address >> 16) & 0xFF, io_r);
+    ++mem_idle_epoch;
+    if (sizeof(TYPE) == 2)
+        return page.io->read16(address);
+    return page.io->read8(address);
 }
 
 template<class TYPE>
-void m68k_write_memory(unsigned int address, unsigned int value)
-{
-    assert((address >> 16) < 256);
-    unsigned long t = (unsigned long)m68k_memtable[address >> 16];
-    if (t) {
-        if (!(t & 1)) {
-            if (t & 2)
-            {
-                mem_err("MEM", "Writing to ROM: %06x <- %0*x\n", address, (int)sizeof(TYPE)*2, value);
-                //assert(0);
-                return;
-            }
-            t = (t & ~3) + (address & 0xFFFF);
-            if (sizeof(TYPE) == 2)
-                *(uint16_t*)t = SWAP16(value & 0xFFFF);
-            else
-                *(uint8_t*)t = value & 0xFF;
-            return;
-        }
-        if (sizeof(TYPE) == 2)
-           GET_MEMFUNC_PAIR(t)->write16(address, value);
-        else
-           GET_MEMFUNC_PAIR(t)->write8(address, value);
+static inline void m68k_write_memory(unsigned int address, unsigned int value)
+{
+    const mempage &page = m68k_wtable[(address >> 16) & 0xFF];
+    ++mem_idle_epoch;
+    if (page.mem) {
+        HEAT(m68k_heat, (address >> 16) & 0xFF, mem_w);
+        uint8_t *mem = page.mem + (address & 0xFFFF);
+        if (sizeof(TYPE) == 2) {
+            mem[0] = value >> 8;
+            mem[1] = value;
+        } else
+            mem[0] = value;
         return;
     }
-    mem_err("MEM", "unknown write%ld at %06x: %0*x\n",
-        sizeof(TYPE)*8, address, (int)sizeof(TYPE)*2, value);
+    HEAT(m68k_heat, (address >> 16) & 0xFF, io_w);
+    if (sizeof(TYPE) == 2)
+        page.io->write16(address, value & 0xFFFF);
+    else
+        page.io->write8(address, value & 0xFF);
 }
 
 unsigned int m68k_read_memory_8(unsigned int address)
@@ -332,6 +382,14 @@ unsigned int  m68k_read_memory_16(unsigned int address)
 }
 unsigned int  m68k_read_memory_32(unsigned int address)
 {
+    // Single load when both words are in the same memory page
+    const mempage &page = m68k_rtable[(address >> 16) & 0xFF];
+    if (page.mem && (address & 0xFFFF) <= 0xFFFC) {
+        HEAT(m68k_heat, (address >> 16) & 0xFF, mem_r);
+        uint32_t value;
+        memcpy(&value, page.mem + (address & 0xFFFF), 4);
+        return __builtin_bswap32(value);
+    }
     return (m68k_read_memory<uint16_t>(address) << 16) | m68k_read_memory<uint16_t>(address+2);
 }
 unsigned int  m68k_read_disassembler_16(unsigned int address)
@@ -344,6 +402,12 @@ unsigned int  m68k_read_disassembler_32(unsigned int address)
 }
 
 
+const unsigned char *m68k_fetch_page(unsigned int address)
+{
+    const mempage &page = m68k_rtable[(address >> 16) & 0xFF];
+    return page.mem;
+}
+
 void m68k_write_memory_8(unsigned int address, unsigned int value)
 {
     m68k_write_memory<uint8_t>(address, value);
@@ -352,86 +416,170 @@ void m68k_write_memory_16(unsigned int address, unsigned int value)
 {
     m68k_write_memory<uint16_t>(address, value);
 }
+// Single store when both words are in the same memory page; the order
+// of the two word writes only matters to I/O handlers.
+static inline bool m68k_write_direct_32(unsigned int address, unsigned int value)
+{
+    const mempage &page = m68k_wtable[(address >> 16) & 0xFF];
+    if (page.mem && (address & 0xFFFF) <= 0xFFFC) {
+        HEAT(m68k_heat, (address >> 16) & 0xFF, mem_w);
+        ++mem_idle_epoch;
+        uint32_t v = __builtin_bswap32(value);
+        memcpy(page.mem + (address & 0xFFFF), &v, 4);
+        return true;
+    }
+    return false;
+}
 void m68k_write_memory_32(unsigned int address, unsigned int value)
 {
+    if (m68k_write_direct_32(address, value))
+        return;
     m68k_write_memory<uint16_t>(address, value >> 16);
     m68k_write_memory<uint16_t>(address+2, value & 0xFFFF);
 }
 void m68k_write_memory_32_pd(unsigned int address, unsigned int value)
 {
+    if (m68k_write_direct_32(address, value))
+        return;
     m68k_write_memory<uint16_t>(address+2, value & 0xFFFF);
     m68k_write_memory<uint16_t>(address, value >> 16);
 }
 
 void WrZ80(register word Addr,register byte Value)
 {
-    void *t = z80_memtable[Addr >> 12];
-    if (t) {
-        if (!((unsigned long)t & 1)) {
-            *(uint8_t*)((uint8_t*)t + (Addr & 0xFFF)) = Value;
-            return;
-        }
-        GET_MEMFUNC_PAIR(t)->write8(Addr, Value);
+    const mempage &page = z80_wtable[Addr >> 12];
+    if (page.mem) {
+        HEAT(z80_heat, Addr >> 12, mem_w);
+        page.mem[Addr & 0xFFF] = Value;
         return;
     }
-    mem_log("Z80MEM", "unknown write at %04x: %02x\n", Addr, Value);
+    HEAT(z80_heat, Addr >> 12, io_w);
+    page.io->write8(Addr, Value);
 }
 byte RdZ80(register word Addr)
 {
-    void *t = z80_memtable[Addr >> 12];
-    if (t) {
-        if (!((unsigned long)t & 1))
-            return *(uint8_t*)((uint8_t*)t + (Addr & 0xFFF));
-        return GET_MEMFUNC_PAIR(t)->read8(Addr);
+    const mempage &page = z80_rtable[Addr >> 12];
+    if (page.mem) {
+        HEAT(z80_heat, Addr >> 12, mem_r);
+        return page.mem[Addr & 0xFFF];
     }
-    mem_log("Z80MEM", "unknown read at %04x\n", Addr);
-    return 0xFF;
+    HEAT(z80_heat, Addr >> 12, io_r);
+    return page.io->read8(Addr);
 }
 void OutZ80(register word Port,register byte Value)
 {
     Port &= 0xFF;
-    mem_log("Z80MEM", "unknown I/O write at Port %04x: %02x\n", Port, Value);
+    TRACE(TRACE_Z80, "unknown I/O write at Port %04x: %02x\n", Port, Value);
 }
 byte InZ80(register word Port)
 {
     Port &= 0xFF;
-    mem_log("Z80MEM", "unknown I/O read at Port %04x\n", Port);
+    TRACE(TRACE_Z80, "unknown I/O read at Port %04x\n", Port);
     return 0xFF;
 }
 
 void PatchZ80(register Z80 *R) {}
 
+void mem_free_rom(void)
+{
+    if (ROM_MAPPED)
+        munmap(ROM, ROM_MAPPED);
+    else
+        free(ROM);
+    ROM = NULL;
+    ROM_MAPPED = 0;
+}
+
+// Make part of a mapped ROM writable (copy-on-write, the file is never
+// modified), eg: for Game Genie patches.
+static void rom_make_writable(uint32_t address, size_t size)
+{
+    if (!ROM_MAPPED)
+        return;
+
+    uintptr_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t start = (uintptr_t)(ROM + address) & ~pagemask;
+    uintptr_t end = (uintptr_t)(ROM + address + size + pagemask) & ~pagemask;
+    mprotect((void*)start, end - start, PROT_READ | PROT_WRITE);
+}
+
+// The ROM is mapped privately and read-only, so that it's loaded lazily
+// and its pages are shared with other instances running the same file.
 int load_bin(const char *fn)
 {
-    FILE *f = fopen(fn, "rb");
-    if (!f)
+    int fd = open(fn, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
     {
         fprintf(stderr, "cannot load ROM: %s\n", fn);
-        exit(1);
+        if (fd >= 0)
+            close(fd);
+        return 0;
     }
 
-    fseek(f, 0, SEEK_END);
-    int len = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    // Round up len to 64KB, padding with 0xFF
+    size_t filesize = st.st_size;
+    size_t len = (filesize + 0xFFFF) & ~0xFFFF;
+
+    // Reserve the whole ROM, then map the file over it. The last partial
+    // page of the file is read instead, because the bytes past the end
+    // of the file would be mapped as zeros.
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t mapped = filesize & ~(pagesize - 1);
+    uint8_t *rom = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rom == MAP_FAILED ||
+        (mapped && mmap(rom, mapped, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED))
+    {
+        fprintf(stderr, "cannot map ROM: %s\n", fn);
+        if (rom != MAP_FAILED)
+            munmap(rom, len);
+        close(fd);
+        return 0;
+    }
 
-    // Round up len to 16bit
-    if (len & 0xFFFF)
-        len = (len | 0xFFFF) + 1;
+    memset(rom + mapped, 0xFF, len - mapped);
+    if (pread(fd, rom + mapped, filesize - mapped, mapped) != (ssize_t)(filesize - mapped))
+        fprintf(stderr, "short read on ROM: %s\n", fn);
+    mprotect(rom + mapped, len - mapped, PROT_READ);
+    close(fd);
 
-    ROM = (uint8_t*)malloc(len);
-    memset(ROM, 0xFF, len);
-    fread(ROM, 1, len, f);
-    fclose(f);
+    mem_free_rom();
+    ROM = rom;
+    ROM_MAPPED = len;
     return len;
 }
 
+// SMD blocks are 16KB, with the odd bytes in the first half and the even
+// bytes in the second half.
+static void smd_deinterleave(uint8_t *dst, const uint8_t *src)
+{
+    const uint8_t *odd = src, *even = src + 8*1024;
+    int j = 0;
+
+#ifdef __SSE2__
+    for (; j<8*1024; j+=16)
+    {
+        __m128i o = _mm_loadu_si128((const __m128i*)(odd + j));
+        __m128i e = _mm_loadu_si128((const __m128i*)(even + j));
+        _mm_storeu_si128((__m128i*)(dst + j*2), _mm_unpacklo_epi8(e, o));
+        _mm_storeu_si128((__m128i*)(dst + j*2 + 16), _mm_unpackhi_epi8(e, o));
+    }
+#endif
+    for (; j<8*1024; ++j)
+    {
+        dst[j*2+0] = even[j];
+        dst[j*2+1] = odd[j];
+    }
+}
+
 int load_smd(const char *fn)
 {
     FILE *f = fopen(fn, "rb");
     if (!f)
     {
         fprintf(stderr, "cannot load ROM: %s\n", fn);
-        exit(1);
+        return 0;
     }
 
     int nblocks = 0;
@@ -440,23 +588,23 @@ int load_smd(const char *fn)
         nblocks = 256;
     fseek(f, 512, SEEK_SET);
 
-    ROM = (uint8_t*)malloc(nblocks * 16*1024);
-    uint8_t *buf = ROM;
+    // Read the whole file at once; missing data reads as 0xFF
+    size_t len = nblocks * 16*1024;
+    uint8_t *buf = (uint8_t*)malloc(len);
+    memset(buf, 0xFF, len);
+    fread(buf, 1, len, f);
+    fclose(f);
 
+    mem_free_rom();
+    ROM = (uint8_t*)malloc(len);
     for (int i=0;i<nblocks;++i)
-    {
-        for (int j=0;j<8*1024;++j)
-            buf[j*2+1] = fgetc(f);
-        for (int j=0;j<8*1024;++j)
-            buf[j*2+0] = fgetc(f);
-        buf += 16*1024;
-    }
-    fclose(f);
-    return nblocks*16*1024;
+        smd_deinterleave(ROM + i*16*1024, buf + i*16*1024);
+    free(buf);
+    return len;
 }
 
-#include "cartidge.cpp"
-
+static memfunc_pair UNMAPPED = { unmapped_mem_r8, unmapped_mem_r16, unmapped_mem_w8, unmapped_mem_w16 };
+static memfunc_pair ROMWRITE = { unmapped_mem_r8, unmapped_mem_r16, rom_mem_w8, rom_mem_w16 };
 static memfunc_pair MVDP = { vdp_mem_r8, vdp_mem_r16, vdp_mem_w8, vdp_mem_w16 };
 static memfunc_pair IO = { io_mem_r8, io_mem_r16, io_mem_w8, io_mem_w16 };
 static memfunc_pair EXP = { exp_mem_r8, exp_mem_r16, exp_mem_w8, exp_mem_w16 };
@@ -466,56 +614,118 @@ static memfunc_pair ZBANK = { zbank_mem_r8, NULL, zbank_mem_w8, NULL };
 static memfunc_pair ZVDP = { zvdp_mem_r8, NULL, zvdp_mem_w8, NULL };
 static memfunc_pair YM2612 = { ym2612_mem_r8, NULL, ym2612_mem_w8, NULL };
 
-void mem_z80area(bool active)
+// The code page cached by the 68000 core and the Z80 bank window must be
+// updated whenever the map changes (eg: bankswitches).
+void mem_map_rom(int page, uint8_t *mem)
 {
-    if (active)
-    {
-        m68k_memtable[0xA0] = MEMFUN_PAIR(&Z80AREA);
-    }
-    else
-    {
-        m68k_memtable[0xA0] = NULL;
-    }
+    m68k_fetch_invalidate();
+    m68k_rtable[page].mem = mem;
+    m68k_rtable[page].io = NULL;
+    m68k_wtable[page].mem = NULL;
+    m68k_wtable[page].io = &ROMWRITE;
+    if (page == (Z80_BANK >> 1))
+        mem_z80bank_update();
 }
 
-void mem_init(int romsize)
+void mem_map_ram(int page, uint8_t *mem)
 {
-    int pow2 = 1;
+    m68k_fetch_invalidate();
+    m68k_rtable[page].mem = m68k_wtable[page].mem = mem;
+    m68k_rtable[page].io = m68k_wtable[page].io = NULL;
+    if (page == (Z80_BANK >> 1))
+        mem_z80bank_update();
+}
+
+void mem_map_io(int page, memfunc_pair *io)
+{
+    m68k_fetch_invalidate();
+    m68k_rtable[page].mem = m68k_wtable[page].mem = NULL;
+    m68k_rtable[page].io = m68k_wtable[page].io = io;
+    if (page == (Z80_BANK >> 1))
+        mem_z80bank_update();
+}
+
+static void z80_map_ram(int page, uint8_t *mem)
+{
+    z80_rtable[page].mem = z80_wtable[page].mem = mem;
+    z80_rtable[page].io = z80_wtable[page].io = NULL;
+}
+
+static void z80_map_io(int page, memfunc_pair *io)
+{
+    z80_rtable[page].mem = z80_wtable[page].mem = NULL;
+    z80_rtable[page].io = z80_wtable[page].io = io;
+}
 
-    romsize /= 65536;
-    while (pow2 < romsize)
-        pow2 <<= 1;
+// Point the Z80 bank window (0x8000-0xFFFF) straight at the 68000 memory
+// it selects; pages without memory on the 68000 side (I/O, or ROM for
+// writes) go through the bank handlers.
+void mem_z80bank_update(void)
+{
+    uint32_t base = Z80_BANK << 15;
+    const mempage &rpage = m68k_rtable[base >> 16];
+    const mempage &wpage = m68k_wtable[base >> 16];
 
-    // Mirror ROM in the range 0x00-0x3F
-    // (but respect power-of-two since hardware won't mirror
-    // in non-pow2 multiples).
-    for (int j=0;j<0x40;j+=pow2)
+    for (int i=0;i<8;++i)
     {
-        mem_log("ROM", "Mirror from %02x0000\n", j);
-        for (int i=0;i<romsize;++i)
-            m68k_memtable[i+j] = MEMFUN_READONLY(ROM + i*65536);
+        uint32_t offset = (base & 0xFFFF) + i*0x1000;
+        z80_rtable[0x8+i].mem = rpage.mem ? rpage.mem + offset : NULL;
+        z80_wtable[0x8+i].mem = wpage.mem ? wpage.mem + offset : NULL;
+        z80_rtable[0x8+i].io = z80_wtable[0x8+i].io = &ZBANK;
     }
+}
+
+void mem_z80area(bool active)
+{
+    mem_map_io(0xA0, active ? &Z80AREA : &UNMAPPED);
+}
 
-    m68k_memtable[0xA1] = MEMFUN_PAIR(&IO);
+#include "cartidge.cpp"
+
+bool mem_alloc(void)
+{
+    RAM = (uint8_t*)calloc(1, RAM_SIZE);
+    backup_ram_mem = (uint8_t*)calloc(1, BACKUP_RAM_SIZE);
+    BACKUP_RAM = backup_ram_mem;
+    return RAM && backup_ram_mem;
+}
+
+void mem_free(void)
+{
+    free(RAM);
+    free(backup_ram_mem);
+    RAM = BACKUP_RAM = backup_ram_mem = NULL;
+}
+
+void mem_init(int romsize)
+{
+    // Start from a clean memory map, this thread might have hosted
+    // another machine before.
+    for (int i=0;i<0x100;++i)
+        mem_map_io(i, &UNMAPPED);
+    memset(RAM, 0, RAM_SIZE);
+    memset(ZRAM, 0, sizeof(ZRAM));
+    Z80_BANK = 0;
+
+    mem_map_io(0xA1, &IO);
     for (int i=0xA2;i<0xC0;i++)
-        m68k_memtable[i] = MEMFUN_PAIR(&EXP);
-    m68k_memtable[0xC0] = MEMFUN_PAIR(&MVDP);
-    m68k_memtable[0xC8] = MEMFUN_PAIR(&MVDP);
-    m68k_memtable[0xD0] = MEMFUN_PAIR(&MVDP);
-    m68k_memtable[0xD8] = MEMFUN_PAIR(&MVDP);
+        mem_map_io(i, &EXP);
+    mem_map_io(0xC0, &MVDP);
+    mem_map_io(0xC8, &MVDP);
+    mem_map_io(0xD0, &MVDP);
+    mem_map_io(0xD8, &MVDP);
     for (int i=0xE0;i<0x100;++i)
-        m68k_memtable[i] = RAM;
-
-    z80_memtable[0x0] = ZRAM;
-    z80_memtable[0x1] = ZRAM + 0x1000;
-    z80_memtable[0x2] = ZRAM;
-    z80_memtable[0x3] = ZRAM + 0x1000;
-    z80_memtable[0x4] = MEMFUN_PAIR(&YM2612);
-    z80_memtable[0x5] = MEMFUN_PAIR(&YM2612);
-    z80_memtable[0x6] = MEMFUN_PAIR(&ZBANKREG);
-    z80_memtable[0x7] = MEMFUN_PAIR(&ZVDP);
-    for (int i=0x8;i<0x10;++i)
-        z80_memtable[i] = MEMFUN_PAIR(&ZBANK);
+        mem_map_ram(i, RAM);
+
+    z80_map_ram(0x0, ZRAM);
+    z80_map_ram(0x1, ZRAM + 0x1000);
+    z80_map_ram(0x2, ZRAM);
+    z80_map_ram(0x3, ZRAM + 0x1000);
+    z80_map_io(0x4, &YM2612);
+    z80_map_io(0x5, &YM2612);
+    z80_map_io(0x6, &ZBANKREG);
+    z80_map_io(0x7, &ZVDP);
+    mem_z80bank_update();
 
     VERSION_OVERSEA = 1;
     VERSION_PAL = 0;
@@ -524,27 +734,71 @@ void mem_init(int romsize)
     YM2612Config(9);
     YM2612ResetChip();
 
-    cartidge_init();
+    // The ROM area is mapped by the cartridge mapper
+    cartidge_init(romsize);
 }
 
-#if !DISABLE_LOGGING
-void mem_log(const char *subs, const char *fmt, ...)
+#if MEM_HEATMAP
+void mem_heatmap_reset(void)
 {
-    extern int framecounter;
-    va_list va;
+    memset(m68k_heat, 0, sizeof(m68k_heat));
+    memset(z80_heat, 0, sizeof(z80_heat));
+}
 
-    if (activecpu == 0)
-        fprintf(stdout, "[%s][MPC=%06x](%04d) ", subs, CPU_M68K.PPC(), framecounter);
-    else
-        fprintf(stdout, "[%s][ZPC=%06x](%04d) ", subs, CPU_Z80.PC(), framecounter);
-    va_start(va, fmt);
-    vfprintf(stdout, fmt, va);
-    va_end(va);
+static const char *heat_page_name(const mempage &page)
+{
+    if (page.mem)
+        return "memory";
+    if (page.io == &MVDP || page.io == &ZVDP) return "VDP";
+    if (page.io == &IO) return "I/O";
+    if (page.io == &EXP) return "expansion";
+    if (page.io == &Z80AREA) return "Z80 area";
+    if (page.io == &ZBANK) return "68000 bank";
+    if (page.io == &ZBANKREG) return "bank register";
+    if (page.io == &YM2612) return "YM2612";
+    if (page.io == &UNMAPPED) return "unmapped";
+    return "cartridge";
+}
+
+static void heat_report(const char *cpu, const memheat *heat, const mempage *rtable,
+    int npages, int shift, int frames)
+{
+    fprintf(stderr, "%s accesses per frame:\n", cpu);
+    fprintf(stderr, "  page      area             mem reads  mem writes    io reads   io writes\n");
+    for (int i=0;i<npages;++i)
+    {
+        const memheat &h = heat[i];
+        if (!h.mem_r && !h.mem_w && !h.io_r && !h.io_w)
+            continue;
+        fprintf(stderr, "  %06x    %-13s %12.1f %11.1f %11.1f %11.1f\n",
+            i << shift, heat_page_name(rtable[i]),
+            (double)h.mem_r / frames, (double)h.mem_w / frames,
+            (double)h.io_r / frames, (double)h.io_w / frames);
+    }
+}
+
+void mem_heatmap_report(int frames)
+{
+    if (frames <= 0)
+        frames = 1;
+    heat_report("68000", m68k_heat, m68k_rtable, 256, 16, frames);
+    heat_report("Z80", z80_heat, z80_rtable, 16, 12, frames);
+}
+#endif
+
+void mem_idle_stable_until(uint64_t clock)
+{
+    // Only for reads by the 68000, that bumped the epoch
+    if (activecpu != 0)
+        return;
+    --mem_idle_epoch;
+    mem_idle_horizon = MIN(mem_idle_horizon, clock);
 }
 
+#if !DISABLE_LOGGING
 void mem_err(const char *subs, const char *fmt, ...)
 {
-    extern int framecounter;
+    extern MACHINE_LOCAL int framecounter;
     va_list va;
 
     if (activecpu == 0)
@@ -585,6 +839,7 @@ bool mem_apply_gamegenie(const char *gg)
     uint16_t value = (val0 << 8) | val1;
 
     fprintf(stderr, "GG code: %s (%06x:%04x)\n", gg, address, value);
+    rom_make_writable(address, 2);
     ROM[address+0] = val0;
     ROM[address+1] = val1;
     return true;
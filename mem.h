@@ -1,3 +1,4 @@
+#include "machine.h"
 
 #define BIT(v, idx)       (((v) >> (idx)) & 1)
 #define BITS(v, idx, n)   (((v) >> (idx)) & ((1<<(n))-1))
@@ -9,15 +10,75 @@
 
 #define DISABLE_LOGGING   0
 
+// Count the memory accesses of each page (see mem_heatmap_report);
+// enabled with cmake -DENABLE_HEATMAP=ON.
+#ifndef MEM_HEATMAP
+#define MEM_HEATMAP       0
+#endif
+
+typedef unsigned int (*memfunc_r)(unsigned int address);
+typedef void         (*memfunc_w)(unsigned int address, unsigned int value);
+
+struct memfunc_pair {
+    memfunc_r read8, read16;
+    memfunc_w write8, write16;
+};
+
+// A page of the memory map: either host memory (accessed directly,
+// big-endian like the 68000 sees it) or, if mem is NULL, I/O handlers.
+struct mempage {
+    uint8_t *mem;
+    memfunc_pair *io;
+};
+
+extern MACHINE_LOCAL mempage m68k_rtable[256];
+extern MACHINE_LOCAL mempage m68k_wtable[256];
+
+void mem_map_rom(int page, uint8_t *mem);
+void mem_map_ram(int page, uint8_t *mem);
+void mem_map_io(int page, memfunc_pair *io);
+
+// Remap the Z80 bank window after Z80_BANK has changed
+void mem_z80bank_update(void);
+
+// The large memories (RAM, backup RAM) are allocated on the heap for
+// each machine, instead of in the thread-local storage of every thread.
+// mem_alloc returns false if it's out of memory.
+#define RAM_SIZE          0x10000
+bool mem_alloc(void);
+void mem_free(void);
+
 void mem_init(int romsize);
 int load_bin(const char *fn);
 int load_smd(const char *fn);
+void mem_free_rom(void);
 bool mem_apply_gamegenie(const char *gg);
 
+// Battery-backed RAM of the cartridge (if any), kept in the specified
+// file; mem_sram_flush() writes it back if it was modified.
+#define BACKUP_RAM_SIZE   0x10000
+bool mem_sram_open(const char *fn);
+void mem_sram_flush(void);
+void mem_sram_close(void);
+
+// Idle loop detection (see cpu.cpp): every write and every I/O access of
+// the 68000 bumps mem_idle_epoch. An I/O read handler whose value can't
+// change (and that has no other effect) until a given master clock calls
+// mem_idle_stable_until() instead, which cancels the bump.
+extern MACHINE_LOCAL uint32_t mem_idle_epoch;
+extern MACHINE_LOCAL uint64_t mem_idle_horizon;
+void mem_idle_stable_until(uint64_t clock);
+
+#if MEM_HEATMAP
+	void mem_heatmap_reset(void);
+	void mem_heatmap_report(int frames);
+#else
+	static inline void mem_heatmap_reset(void) {}
+	static inline void mem_heatmap_report(int) {}
+#endif
+
 #if DISABLE_LOGGING
-	#define mem_log(...)  do {} while(0)
 	#define mem_err(...)  do {} while(0)
 #else
-	void mem_log(const char *subs, const char *fmt, ...);
 	void mem_err(const char *subs, const char *fmt, ...);
 #endif
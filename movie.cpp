@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "machine.h"
+#include "ioports.h"
+#include "movie.h"
+
+/*
+ * Movie file format (integers are little-endian):
+ *
+ *   0x00  "GMOV"
+ *   0x04  uint32 version (1)
+ *   0x08  uint32 flags: bit 0 = PAL
+ *   0x0C  uint32 number of frames
+ *   0x10  16 bytes: ROM header at 0x180 (serial number and checksum)
+ *   0x20  for each frame: pad 1 buttons, pad 2 buttons (PAD_* bits)
+ */
+
+#define MOVIE_VERSION       1
+#define MOVIE_HEADER_SIZE   0x20
+#define MOVIE_FLAG_PAL      (1<<0)
+
+extern MACHINE_LOCAL uint8_t *ROM;
+extern MACHINE_LOCAL int VERSION_PAL;
+
+enum { MOVIE_NONE, MOVIE_RECORD, MOVIE_PLAY };
+
+static MACHINE_LOCAL int mv_mode;
+static MACHINE_LOCAL FILE *mv_file;
+static MACHINE_LOCAL uint32_t mv_frame;
+static MACHINE_LOCAL uint32_t mv_length;
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+bool movie_record(const char *fn)
+{
+    uint8_t hdr[MOVIE_HEADER_SIZE];
+
+    movie_stop();
+    mv_file = fopen(fn, "wb");
+    if (!mv_file)
+    {
+        fprintf(stderr, "ERROR: cannot create movie %s\n", fn);
+        return false;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, "GMOV", 4);
+    put32(hdr + 0x04, MOVIE_VERSION);
+    put32(hdr + 0x08, VERSION_PAL ? MOVIE_FLAG_PAL : 0);
+    memcpy(hdr + 0x10, ROM + 0x180, 16);
+    fwrite(hdr, 1, sizeof(hdr), mv_file);
+
+    mv_mode = MOVIE_RECORD;
+    mv_frame = 0;
+    return true;
+}
+
+// Open a movie and read its header; NULL if it's not a valid movie
+static FILE *open_movie(const char *fn, uint8_t hdr[MOVIE_HEADER_SIZE])
+{
+    FILE *f = fopen(fn, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "ERROR: cannot open movie %s\n", fn);
+        return NULL;
+    }
+
+    if (fread(hdr, 1, MOVIE_HEADER_SIZE, f) != MOVIE_HEADER_SIZE ||
+        memcmp(hdr, "GMOV", 4) != 0 || get32(hdr + 0x04) != MOVIE_VERSION)
+    {
+        fprintf(stderr, "ERROR: %s is not a valid movie\n", fn);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+bool movie_region(const char *fn, bool *pal)
+{
+    uint8_t hdr[MOVIE_HEADER_SIZE];
+
+    FILE *f = open_movie(fn, hdr);
+    if (!f)
+        return false;
+    fclose(f);
+    *pal = (get32(hdr + 0x08) & MOVIE_FLAG_PAL) != 0;
+    return true;
+}
+
+bool movie_play(const char *fn)
+{
+    uint8_t hdr[MOVIE_HEADER_SIZE];
+
+    movie_stop();
+    mv_file = open_movie(fn, hdr);
+    if (!mv_file)
+        return false;
+
+    if (memcmp(hdr + 0x10, ROM + 0x180, 16) != 0)
+        fprintf(stderr, "WARNING: movie %s was recorded with a different ROM\n", fn);
+
+    VERSION_PAL = (get32(hdr + 0x08) & MOVIE_FLAG_PAL) ? 1 : 0;
+    mv_length = get32(hdr + 0x0C);
+    mv_mode = MOVIE_PLAY;
+    mv_frame = 0;
+    return true;
+}
+
+void movie_stop(void)
+{
+    if (mv_mode == MOVIE_RECORD)
+    {
+        uint8_t count[4];
+        put32(count, mv_frame);
+        fseek(mv_file, 0x0C, SEEK_SET);
+        fwrite(count, 1, 4, mv_file);
+    }
+    if (mv_file)
+        fclose(mv_file);
+
+    mv_file = NULL;
+    mv_mode = MOVIE_NONE;
+}
+
+bool movie_frame(void)
+{
+    uint8_t pads[2];
+
+    switch (mv_mode)
+    {
+    case MOVIE_RECORD:
+        pads[0] = ioports_get_pad(0);
+        pads[1] = ioports_get_pad(1);
+        fwrite(pads, 1, 2, mv_file);
+        ++mv_frame;
+        return true;
+
+    case MOVIE_PLAY:
+        if (mv_frame >= mv_length || fread(pads, 1, 2, mv_file) != 2)
+        {
+            movie_stop();
+            ioports_set_pad(0, 0);
+            ioports_set_pad(1, 0);
+            return false;
+        }
+        ioports_set_pad(0, pads[0]);
+        ioports_set_pad(1, pads[1]);
+        ++mv_frame;
+        return true;
+
+    default:
+        return true;
+    }
+}
+
+bool movie_active(void)
+{
+    return mv_mode != MOVIE_NONE;
+}
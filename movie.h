@@ -0,0 +1,25 @@
+#ifndef __MOVIE_H__
+#define __MOVIE_H__
+
+// Input movies: the state of both pads for every frame since power-on,
+// so that a session can be replayed identically without a keyboard.
+// movie_frame() must be called once before emulating each frame: when
+// recording it saves the pad state set by the frontend, when playing
+// it overrides it with the recorded one.
+
+// Start recording/playing; the machine must have just been powered on.
+// Playing also switches the region to the one of the recording.
+bool movie_record(const char *fn);
+bool movie_play(const char *fn);
+void movie_stop(void);
+
+// Region the movie was recorded in, to configure the console (and the
+// frontend timings) before playing it; false if it's not a valid movie
+bool movie_region(const char *fn, bool *pal);
+
+// Returns false when playback reaches the end of the movie (and stops it)
+bool movie_frame(void);
+
+bool movie_active(void);
+
+#endif
@@ -0,0 +1,75 @@
+#include "prof.h"
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+MACHINE_LOCAL bool prof_enabled;
+
+static const char *prof_names[PROF_NUM] = { "M68K", "Z80", "VDP", "YM2612" };
+
+static MACHINE_LOCAL uint64_t prof_time[PROF_NUM];
+static MACHINE_LOCAL uint64_t prof_start;
+static MACHINE_LOCAL uint64_t prof_last;
+
+// Stack of active subsystems; -1 means time spent outside of any of them
+// (main loop, frontend, etc.)
+static MACHINE_LOCAL int prof_stack[16];
+static MACHINE_LOCAL int prof_depth;
+
+static uint64_t prof_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void prof_account(uint64_t now)
+{
+    if (prof_depth > 0)
+        prof_time[prof_stack[prof_depth-1]] += now - prof_last;
+    prof_last = now;
+}
+
+void prof_reset(void)
+{
+    for (int i=0;i<PROF_NUM;++i)
+        prof_time[i] = 0;
+    prof_depth = 0;
+    prof_start = prof_last = prof_now();
+}
+
+void prof_push(int subsys)
+{
+    assert(prof_depth < (int)(sizeof(prof_stack)/sizeof(prof_stack[0])));
+    prof_account(prof_now());
+    prof_stack[prof_depth++] = subsys;
+}
+
+void prof_pop(void)
+{
+    assert(prof_depth > 0);
+    prof_account(prof_now());
+    --prof_depth;
+}
+
+void prof_report(int frames)
+{
+    uint64_t total = prof_now() - prof_start;
+    uint64_t other = total;
+
+    if (total == 0)
+        total = 1;
+
+    fprintf(stderr, "Emulated %d frames in %.3f s (%.1f FPS)\n",
+        frames, total / 1e9, frames * 1e9 / total);
+
+    for (int i=0;i<PROF_NUM;++i)
+    {
+        fprintf(stderr, "  %-8s %10.3f ms  %5.1f%%  (%.3f ms/frame)\n",
+            prof_names[i], prof_time[i] / 1e6, prof_time[i] * 100.0 / total,
+            frames ? prof_time[i] / 1e6 / frames : 0.0);
+        other -= prof_time[i];
+    }
+    fprintf(stderr, "  %-8s %10.3f ms  %5.1f%%\n",
+        "other", other / 1e6, other * 100.0 / total);
+}
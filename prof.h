@@ -0,0 +1,31 @@
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include <stdint.h>
+#include "machine.h"
+
+// Subsystems tracked by the profiler. Time is accounted exclusively:
+// a subsystem entered while another one is running (eg: a VDP DMA
+// triggered by the 68000) is subtracted from the outer one.
+enum
+{
+    PROF_M68K,
+    PROF_Z80,
+    PROF_VDP,
+    PROF_YM2612,
+
+    PROF_NUM
+};
+
+extern MACHINE_LOCAL bool prof_enabled;
+
+void prof_reset(void);
+void prof_push(int subsys);
+void prof_pop(void);
+void prof_report(int frames);
+
+// Wrap a subsystem call; costs a single branch when profiling is off.
+#define PROF_BEGIN(subsys)   do { if (prof_enabled) prof_push(subsys); } while(0)
+#define PROF_END()           do { if (prof_enabled) prof_pop(); } while(0)
+
+#endif
@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "machine.h"
+#include "state.h"
+#include "rewind.h"
+
+/*
+ * Rewind history.
+ *
+ * The most recent snapshot is kept in full (rw_last); the ring buffer
+ * contains a chain of backward deltas, each of which turns a snapshot
+ * into the one captured just before it. A delta is the XOR of the two
+ * snapshots, which is mostly zero (RAM, VRAM, etc. change little between
+ * frames), compressed with a run-length encoding of the zero words.
+ * Since deltas go backward, dropping the oldest ones when the buffer is
+ * full just shortens the history.
+ *
+ * Encoded delta: a sequence of runs, each one made of
+ *    uint16_t zeros        number of zero words to skip
+ *    uint16_t literals     number of words that follow
+ *    uint64_t words[literals]
+ *
+ * Ring buffer entry: uint32_t size, encoded delta, uint32_t size
+ * (the size is repeated so that the ring can be walked from both ends).
+ */
+
+static MACHINE_LOCAL uint8_t *rw_ring;
+static MACHINE_LOCAL size_t rw_ring_size;
+static MACHINE_LOCAL size_t rw_head, rw_tail;   // newest end, oldest end
+static MACHINE_LOCAL size_t rw_used;
+static MACHINE_LOCAL int rw_count;              // deltas in the ring
+
+static MACHINE_LOCAL uint64_t *rw_last;         // most recent snapshot
+static MACHINE_LOCAL uint64_t *rw_cur;          // scratch snapshot
+static MACHINE_LOCAL uint8_t *rw_delta;         // scratch encoded delta
+static MACHINE_LOCAL size_t rw_words;           // snapshot size in words
+static MACHINE_LOCAL bool rw_valid;             // rw_last contains a snapshot
+
+static MACHINE_LOCAL int rw_interval;
+static MACHINE_LOCAL int rw_frames;
+
+static void ring_write(size_t pos, const void *data, size_t size)
+{
+    size_t first = rw_ring_size - pos;
+    if (first > size)
+        first = size;
+    memcpy(rw_ring + pos, data, first);
+    memcpy(rw_ring, (const uint8_t*)data + first, size - first);
+}
+
+static void ring_read(size_t pos, void *data, size_t size)
+{
+    size_t first = rw_ring_size - pos;
+    if (first > size)
+        first = size;
+    memcpy(data, rw_ring + pos, first);
+    memcpy((uint8_t*)data + first, rw_ring, size - first);
+}
+
+static size_t ring_wrap(size_t pos)
+{
+    return pos >= rw_ring_size ? pos - rw_ring_size : pos;
+}
+
+// Drop the oldest delta
+static void ring_drop(void)
+{
+    uint32_t size;
+
+    assert(rw_count > 0);
+    ring_read(rw_tail, &size, 4);
+    rw_tail = ring_wrap(rw_tail + size + 8);
+    rw_used -= size + 8;
+    --rw_count;
+}
+
+static void ring_push(const uint8_t *data, uint32_t size)
+{
+    if (size + 8 > rw_ring_size)
+    {
+        // Can't fit even in an empty ring: the history is lost
+        while (rw_count)
+            ring_drop();
+        return;
+    }
+
+    while (rw_used + size + 8 > rw_ring_size)
+        ring_drop();
+
+    ring_write(rw_head, &size, 4);
+    ring_write(ring_wrap(rw_head + 4), data, size);
+    ring_write(ring_wrap(rw_head + 4 + size), &size, 4);
+    rw_head = ring_wrap(rw_head + size + 8);
+    rw_used += size + 8;
+    ++rw_count;
+}
+
+// Remove the newest delta, copying it into data; returns its size
+static uint32_t ring_pop(uint8_t *data)
+{
+    uint32_t size;
+
+    assert(rw_count > 0);
+    ring_read(ring_wrap(rw_head + rw_ring_size - 4), &size, 4);
+    rw_head = ring_wrap(rw_head + rw_ring_size - size - 8);
+    ring_read(ring_wrap(rw_head + 4), data, size);
+    rw_used -= size + 8;
+    --rw_count;
+    return size;
+}
+
+// Encode a ^ b into out; returns the encoded size
+static uint32_t delta_encode(uint8_t *out, const uint64_t *a, const uint64_t *b, size_t words)
+{
+    uint8_t *p = out;
+    size_t i = 0;
+
+    while (i < words)
+    {
+        uint16_t zeros = 0, literals = 0;
+
+        while (i < words && zeros < 0xFFFF && a[i] == b[i])
+            ++zeros, ++i;
+
+        uint8_t *hdr = p;
+        p += 4;
+        while (i < words && literals < 0xFFFF && a[i] != b[i])
+        {
+            uint64_t x = a[i] ^ b[i];
+            memcpy(p, &x, 8);
+            p += 8;
+            ++literals, ++i;
+        }
+
+        memcpy(hdr, &zeros, 2);
+        memcpy(hdr+2, &literals, 2);
+    }
+
+    return p - out;
+}
+
+// XOR an encoded delta into dst
+static void delta_apply(uint64_t *dst, const uint8_t *delta, uint32_t size)
+{
+    const uint8_t *p = delta, *end = delta + size;
+    size_t i = 0;
+
+    while (p < end)
+    {
+        uint16_t zeros, literals;
+        memcpy(&zeros, p, 2);
+        memcpy(&literals, p+2, 2);
+        p += 4;
+
+        i += zeros;
+        for (int j=0; j<literals; ++j)
+        {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            dst[i++] ^= x;
+            p += 8;
+        }
+    }
+}
+
+void rewind_free(void)
+{
+    free(rw_ring);
+    free(rw_last);
+    free(rw_cur);
+    free(rw_delta);
+    rw_ring = NULL;
+    rw_last = rw_cur = NULL;
+    rw_delta = NULL;
+    rw_valid = false;
+}
+
+void rewind_init(size_t bufsize, int interval)
+{
+    rewind_free();
+
+    // Work on whole words; the padding is always zero
+    rw_words = (state_size() + 7) / 8;
+    rw_last = (uint64_t*)calloc(rw_words, 8);
+    rw_cur = (uint64_t*)calloc(rw_words, 8);
+    // Worst case: one run header every literal word
+    rw_delta = (uint8_t*)malloc(rw_words * 12 + 4);
+
+    rw_ring = (uint8_t*)malloc(bufsize);
+    rw_ring_size = bufsize;
+    rw_head = rw_tail = rw_used = 0;
+    rw_count = 0;
+
+    rw_interval = interval > 0 ? interval : 1;
+    rw_frames = 0;
+}
+
+void rewind_frame(void)
+{
+    if (!rw_ring || ++rw_frames < rw_interval)
+        return;
+    rw_frames = 0;
+
+    state_save_to((uint8_t*)rw_cur);
+    if (rw_valid)
+        ring_push(rw_delta, delta_encode(rw_delta, rw_cur, rw_last, rw_words));
+
+    uint64_t *tmp = rw_last;
+    rw_last = rw_cur;
+    rw_cur = tmp;
+    rw_valid = true;
+}
+
+bool rewind_step(void)
+{
+    if (!rw_valid)
+        return false;
+
+    state_load_from((uint8_t*)rw_last);
+    rw_frames = 0;
+
+    // Move to the previous snapshot; the oldest one is kept so that
+    // rewinding stops there.
+    if (rw_count > 0)
+        delta_apply(rw_last, rw_delta, ring_pop(rw_delta));
+    return true;
+}
@@ -0,0 +1,18 @@
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+#include <stddef.h>
+
+// Rewind history: a snapshot of the machine is captured every "interval"
+// frames into a ring buffer of bufsize bytes, where the oldest snapshots
+// are dropped as needed. Must be called after the ROM has been loaded.
+void rewind_init(size_t bufsize, int interval);
+void rewind_free(void);
+
+// Call after each emulated frame (except while rewinding)
+void rewind_frame(void);
+
+// Go back to the previous snapshot. Returns false if there's no history.
+bool rewind_step(void);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include "sched.h"
+#include "vdp.h"
+#include "cpu.h"
+#include "mem.h"
+#include "prof.h"
+extern "C" {
+    #include "ym2612/ym2612.h"
+}
+
+/*
+ * Event-driven scheduler.
+ *
+ * Instead of interleaving the CPUs on every scanline, each timeslice runs
+ * up to the next point in time where something can happen that the CPUs
+ * cannot observe by themselves: an interrupt line raised or lowered by the
+ * VDP (HINT, VINT, Z80 IRQ assert/deassert) or the end of the frame.
+ *
+ * Everything else is synchronized lazily ("catch-up"): the VDP processes
+ * pending scanlines when a CPU accesses its ports, and the YM2612 renders
+ * pending samples when a CPU accesses its registers (which also keeps its
+ * timers exact, so there is no need to stop the CPUs on timer overflows).
+ *
+ * The exception is the Z80 while it's running: it writes the 68000 RAM
+ * (through the bank window) and the YM2612 on its own, so the timeslices
+ * don't cross a line boundary, as the CPUs were interleaved before.
+ */
+
+MACHINE_LOCAL uint64_t MASTER_CLOCK;
+MACHINE_LOCAL int framecounter;
+
+static MACHINE_LOCAL uint64_t slice_end;
+static MACHINE_LOCAL uint64_t frame_start, frame_cycles;
+
+static MACHINE_LOCAL int16_t *audio_buf;
+static MACHINE_LOCAL int audio_nsamples;
+static MACHINE_LOCAL int audio_pos;
+
+// Current time as seen by the running CPU. It is clamped before the end
+// of the timeslice so that a CPU overshooting the slice by its last
+// instruction never observes (or triggers) the event the slice stops at.
+uint64_t sched_clock(void)
+{
+    extern MACHINE_LOCAL int activecpu;
+    uint64_t clock = activecpu ? CPU_Z80.clock() : CPU_M68K.clock();
+
+    if (clock >= slice_end)
+        clock = slice_end - 1;
+    return clock;
+}
+
+// Start of the line following the specified clock
+static uint64_t next_line(uint64_t clock)
+{
+    return frame_start + ((clock - frame_start) / VDP_CYCLES_PER_LINE + 1) * VDP_CYCLES_PER_LINE;
+}
+
+// If next is earlier than the current timeslice end, shorten the slice
+// of the running 68000 accordingly.
+static void shorten_slice(uint64_t next)
+{
+    extern MACHINE_LOCAL int activecpu;
+
+    if (next >= slice_end)
+        return;
+    slice_end = next;
+
+    if (activecpu == 0)
+    {
+        uint64_t clock = CPU_M68K.clock();
+        int remaining = 0;
+        if (clock < next)
+            remaining = (next - clock + M68K_FREQ_DIVISOR - 1) / M68K_FREQ_DIVISOR;
+        m68k_modify_timeslice(remaining - m68k_cycles_remaining());
+    }
+}
+
+// Called when a VDP register affecting interrupt generation is written
+void sched_vdp_changed(void)
+{
+    shorten_slice(VDP.next_event());
+}
+
+// Called when the 68000 changes the BUSREQ/RESET lines of the Z80: once
+// it's released, stop at the next line to interleave it with the 68000
+void sched_z80_changed(void)
+{
+    if (!CPU_Z80.halted())
+        shorten_slice(next_line(sched_clock()));
+}
+
+// Render YM2612 samples up to the specified clock
+void sched_audio_sync(uint64_t clock)
+{
+    if (!audio_buf || clock <= frame_start)
+        return;
+
+    int pos = (clock - frame_start) * audio_nsamples / frame_cycles;
+    if (pos > audio_nsamples)
+        pos = audio_nsamples;
+    if (pos <= audio_pos)
+        return;
+
+    PROF_BEGIN(PROF_YM2612);
+    YM2612Update(audio_buf + audio_pos*2, pos - audio_pos);
+    PROF_END();
+    audio_pos = pos;
+}
+
+void sched_run_frame(uint8_t *screen, int pitch, int16_t *audio, int nsamples)
+{
+    frame_start = MASTER_CLOCK;
+    frame_cycles = VDP.num_scanlines() * VDP_CYCLES_PER_LINE;
+    uint64_t frame_end = frame_start + frame_cycles;
+
+    audio_buf = audio;
+    audio_nsamples = nsamples;
+    audio_pos = 0;
+
+    VDP.set_framebuffer(screen, pitch);
+
+    while (MASTER_CLOCK < frame_end)
+    {
+        slice_end = MIN(VDP.next_event(), frame_end);
+        if (!CPU_Z80.halted())
+            slice_end = MIN(slice_end, next_line(MASTER_CLOCK));
+
+        PROF_BEGIN(PROF_M68K);
+        CPU_M68K.run(slice_end);
+        PROF_END();
+
+        PROF_BEGIN(PROF_Z80);
+        CPU_Z80.run(slice_end);
+        PROF_END();
+
+        // Process the scanlines up to the event; this is where
+        // interrupts are raised.
+        VDP.sync(slice_end);
+
+        MASTER_CLOCK = slice_end;
+    }
+
+    sched_audio_sync(frame_end);
+    audio_buf = NULL;
+}
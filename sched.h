@@ -0,0 +1,18 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+#include "machine.h"
+
+// Master clock (VDP_MASTER_FREQ) at the end of the last completed
+// timeslice. All the devices are synchronized up to this point.
+extern MACHINE_LOCAL uint64_t MASTER_CLOCK;
+
+void sched_run_frame(uint8_t *screen, int pitch, int16_t *audio, int nsamples);
+
+uint64_t sched_clock(void);
+void sched_vdp_changed(void);
+void sched_z80_changed(void);
+void sched_audio_sync(uint64_t clock);
+
+#endif
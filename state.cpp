@@ -1,9 +1,14 @@
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <vector>
 #include "vdp.h"
+#include "gfx.h"
 #include "cpu.h"
-#include "hw.h"
-#include <SDL.h>
+#include "mem.h"
+#include "ioports.h"
+#include "sched.h"
+#include "state.h"
 
 extern "C" {
     #include "m68k/m68k.h"
@@ -11,219 +16,275 @@ extern "C" {
     #include "ym2612/ym2612.h"
 }
 
-extern int Z80_BANK;
-extern uint8_t RAM[0x10000];
-extern uint8_t ZRAM[0x2000];
-extern char romname[2048];
+extern MACHINE_LOCAL int Z80_BANK;
+extern MACHINE_LOCAL uint8_t *RAM;
+extern MACHINE_LOCAL uint8_t ZRAM[0x2000];
+extern MACHINE_LOCAL int framecounter;
+extern MACHINE_LOCAL bool backup_ram_present;
+extern MACHINE_LOCAL bool backup_ram_dirty;
+extern MACHINE_LOCAL uint8_t *BACKUP_RAM;
+extern MACHINE_LOCAL uint8_t CART_REGS[8];
 
-static void pad(FILE *f, int bytes)
-{
-    uint32_t zero=0;
-    for (int i=0;i<bytes;i++)
-        fwrite(&zero, 1, 1, f);
-}
+void mem_z80area(bool active);
+void cartidge_remap(void);
+
+/**************************************
+ * Genecyst savestates (files)
+ **************************************/
+
+#define GST_SIZE  0x22478
 
 // Use the Genecyst format
 //
 void savestate(const char *fn)
 {
+    std::vector<uint8_t> buf(GST_SIZE);
+    uint8_t *gst = &buf[0];
     uint32_t val;
+
     FILE *f = fopen(fn, "wb");
     assert(f);
 
-    fprintf(f, "GST");
-    assert(ftell(f) == 3);
-    pad(f, 3);
-    assert(ftell(f) == 6);
-    fprintf(f, "\xE0\x40");
-    pad(f, 0x80-8);
-    assert(ftell(f) == 0x80);
+    memcpy(gst, "GST", 3);
+    memcpy(gst + 6, "\xE0\x40", 2);
 
     for (int i=0;i<16;i++)
     {
         val = m68k_get_reg(NULL, (m68k_register_t)i);
-        fwrite(&val, 1, 4, f);
+        memcpy(gst + 0x80 + i*4, &val, 4);
     }
-    assert(ftell(f) == 0xC0);
-    pad(f, 8);
-    assert(ftell(f) == 0xC8);
     val = m68k_get_reg(NULL, M68K_REG_PC);
-    fwrite(&val, 1, 4, f);
-    pad(f, 4);
-    assert(ftell(f) == 0xD0);
+    memcpy(gst + 0xC8, &val, 4);
     val = m68k_get_reg(NULL, M68K_REG_SR);
-    fwrite(&val, 1, 2, f);
+    memcpy(gst + 0xD0, &val, 2);
     val = m68k_get_reg(NULL, M68K_REG_USP);
-    fwrite(&val, 1, 4, f);
+    memcpy(gst + 0xD2, &val, 4);
     val = m68k_get_reg(NULL, M68K_REG_ISP);
-    fwrite(&val, 1, 4, f);
-
-    assert(ftell(f) == 0xDA);
-    pad(f, 0xFA-0xDA);
-    assert(ftell(f) == 0xFA);
-
-    fwrite(VDP.regs, 1, 24, f);
-    fwrite(VDP.CRAM, 1, 128, f);
-    fwrite(VDP.VSRAM, 1, 80, f);
-
-    pad(f, 2);
-    assert(ftell(f) == 0x1E4);
-
-    uint8_t opnregs[512];
-    YM2612SaveRegs(opnregs);
-    fwrite(opnregs, 1, 512, f);
-
-    assert(ftell(f) == 0x3E4);
-    pad(f, 0x404-0x3E4);
-    assert(ftell(f) == 0x404);
-
-    fwrite(&CPU_Z80._cpu.AF.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.BC.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.DE.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.HL.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.IX.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.IY.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.PC.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.SP.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.AF1.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.BC1.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.DE1.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.HL1.W, 1, 4, f);
-    fwrite(&CPU_Z80._cpu.I, 1, 1, f);
-    pad(f, 1);
-    fwrite(&CPU_Z80._cpu.IFF, 1, 1, f);
-    pad(f, 1);
-
-    fwrite(&CPU_Z80._reset_line, 1, 1, f);
-    fwrite(&CPU_Z80._busreq_line, 1, 1, f);
-    pad(f, 1);
-    pad(f, 1);
-    fwrite(&Z80_BANK, 1, 4, f);
-
-    assert(ftell(f) == 0x440);
-    pad(f, 0x474-0x440);
-    assert(ftell(f) == 0x474);
-
-    fwrite(ZRAM, 1, sizeof(ZRAM), f);
-    pad(f, 4);
-    fwrite(RAM, 1, sizeof(RAM), f);
-    fwrite(VDP.VRAM, 1, sizeof(VDP.VRAM), f);
-    assert(ftell(f) == 0x22478);
+    memcpy(gst + 0xD6, &val, 4);
+
+    memcpy(gst + 0xFA, VDP.regs, 24);
+    memcpy(gst + 0x112, VDP.CRAM, 128);
+    memcpy(gst + 0x192, VDP.VSRAM, 80);
+
+    YM2612SaveRegs(gst + 0x1E4);
+
+    // Registers are stored as 32-bit values, but they are 16-bit
+    // pairs in the Z80 struct; each copy also grabs the next one.
+    memcpy(gst + 0x404, &CPU_Z80._cpu.AF.W, 4);
+    memcpy(gst + 0x408, &CPU_Z80._cpu.BC.W, 4);
+    memcpy(gst + 0x40C, &CPU_Z80._cpu.DE.W, 4);
+    memcpy(gst + 0x410, &CPU_Z80._cpu.HL.W, 4);
+    memcpy(gst + 0x414, &CPU_Z80._cpu.IX.W, 4);
+    memcpy(gst + 0x418, &CPU_Z80._cpu.IY.W, 4);
+    memcpy(gst + 0x41C, &CPU_Z80._cpu.PC.W, 4);
+    memcpy(gst + 0x420, &CPU_Z80._cpu.SP.W, 4);
+    memcpy(gst + 0x424, &CPU_Z80._cpu.AF1.W, 4);
+    memcpy(gst + 0x428, &CPU_Z80._cpu.BC1.W, 4);
+    memcpy(gst + 0x42C, &CPU_Z80._cpu.DE1.W, 4);
+    memcpy(gst + 0x430, &CPU_Z80._cpu.HL1.W, 4);
+    gst[0x434] = CPU_Z80._cpu.I;
+    gst[0x436] = CPU_Z80._cpu.IFF;
+    gst[0x438] = CPU_Z80._reset_line;
+    gst[0x439] = CPU_Z80._busreq_line;
+    memcpy(gst + 0x43C, &Z80_BANK, 4);
+
+    memcpy(gst + 0x474, ZRAM, sizeof(ZRAM));
+    memcpy(gst + 0x2478, RAM, RAM_SIZE);
+    memcpy(gst + 0x12478, VDP.VRAM, VRAM_SIZE);
+
+    fwrite(gst, 1, GST_SIZE, f);
     fclose(f);
 }
 
 bool loadstate(const char *fn)
 {
+    std::vector<uint8_t> buf(GST_SIZE);
+    uint8_t *gst = &buf[0];
     uint32_t val;
+
     FILE *f = fopen(fn, "rb");
     if (!f) return false;
+    fread(gst, 1, GST_SIZE, f);
+    fclose(f);
 
-    fseek(f, 0x80, SEEK_SET);
-    CPU_M68K.init();
     for (int i=0;i<16;i++)
     {
-        fread(&val, 1, 4, f);
+        memcpy(&val, gst + 0x80 + i*4, 4);
         m68k_set_reg((m68k_register_t)i, val);
     }
 
-    fseek(f, 0xC8, SEEK_SET);
-    fread(&val, 1, 4, f);
+    memcpy(&val, gst + 0xC8, 4);
     m68k_set_reg(M68K_REG_PC, val);
 
-    fseek(f, 0xD0, SEEK_SET);
-    val = 0; fread(&val, 1, 2, f);
+    val = 0; memcpy(&val, gst + 0xD0, 2);
     //m68k_set_reg(M68K_REG_SR, val);
     m68ki_set_sr_noint_nosp(val);
 
-    val = 0; fread(&val, 1, 4, f);
+    memcpy(&val, gst + 0xD2, 4);
     m68k_set_reg(M68K_REG_USP, val);
-    val = 0; fread(&val, 1, 4, f);
+    memcpy(&val, gst + 0xD6, 4);
     m68k_set_reg(M68K_REG_ISP, val);
 
-    assert(ftell(f) == 0xDA);
-    fseek(f, 0xFA, SEEK_SET);
-
     VDP.reset();
-    fread(VDP.regs, 1, 24, f);
-    fread(VDP.CRAM, 1, 128, f);
-    fread(VDP.VSRAM, 1, 80, f);
-    assert(ftell(f) == 0x1E2);
-
-    fseek(f, 0x1E4, SEEK_SET);
-
-    uint8_t opnregs[512];
-    fread(opnregs, 1, 512, f);
-    YM2612LoadRegs(opnregs);
+    memcpy(VDP.regs, gst + 0xFA, 24);
+    memcpy(VDP.CRAM, gst + 0x112, 128);
+    memcpy(VDP.VSRAM, gst + 0x192, 80);
 
-    assert(ftell(f) == 0x3E4);
-    fseek(f, 0x404, SEEK_SET);
+    YM2612LoadRegs(gst + 0x1E4);
 
     CPU_Z80.reset();
-    fread(&CPU_Z80._cpu.AF.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.BC.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.DE.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.HL.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.IX.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.IY.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.PC.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.SP.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.AF1.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.BC1.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.DE1.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.HL1.W, 1, 4, f);
-    fread(&CPU_Z80._cpu.I, 1, 1, f);
-    fseek(f, 1, SEEK_CUR);
-    fread(&CPU_Z80._cpu.IFF, 1, 1, f);
-    fseek(f, 1, SEEK_CUR);
-
-    fread(&CPU_Z80._reset_line, 1, 1, f);
-    fread(&CPU_Z80._busreq_line, 1, 1, f);
-    fseek(f, 2, SEEK_CUR);
-    fread(&Z80_BANK, 1, 4, f);
+    memcpy(&CPU_Z80._cpu.AF.W, gst + 0x404, 4);
+    memcpy(&CPU_Z80._cpu.BC.W, gst + 0x408, 4);
+    memcpy(&CPU_Z80._cpu.DE.W, gst + 0x40C, 4);
+    memcpy(&CPU_Z80._cpu.HL.W, gst + 0x410, 4);
+    memcpy(&CPU_Z80._cpu.IX.W, gst + 0x414, 4);
+    memcpy(&CPU_Z80._cpu.IY.W, gst + 0x418, 4);
+    memcpy(&CPU_Z80._cpu.PC.W, gst + 0x41C, 4);
+    memcpy(&CPU_Z80._cpu.SP.W, gst + 0x420, 4);
+    memcpy(&CPU_Z80._cpu.AF1.W, gst + 0x424, 4);
+    memcpy(&CPU_Z80._cpu.BC1.W, gst + 0x428, 4);
+    memcpy(&CPU_Z80._cpu.DE1.W, gst + 0x42C, 4);
+    memcpy(&CPU_Z80._cpu.HL1.W, gst + 0x430, 4);
+    CPU_Z80._cpu.I = gst[0x434];
+    CPU_Z80._cpu.IFF = gst[0x436];
+
+    CPU_Z80._reset_line = gst[0x438];
+    CPU_Z80._busreq_line = gst[0x439];
+    memcpy(&Z80_BANK, gst + 0x43C, 4);
+    mem_z80bank_update();
     CPU_Z80._reset_once = true;
 
-    assert(ftell(f) == 0x440);
-    fseek(f, 0x474, SEEK_SET);
-
-    fread(ZRAM, 1, sizeof(ZRAM), f);
-    fseek(f, 4, SEEK_CUR);
-    fread(RAM, 1, sizeof(RAM), f);
-    fread(VDP.VRAM, 1, sizeof(VDP.VRAM), f);
-    assert(ftell(f) == 0x22478);
-    fclose(f);
+    memcpy(ZRAM, gst + 0x474, sizeof(ZRAM));
+    memcpy(RAM, gst + 0x2478, RAM_SIZE);
+    memcpy(VDP.VRAM, gst + 0x12478, VRAM_SIZE);
+    gfx_invalidate();
 
     return true;
 }
 
-char* slotname(int slot)
+/**************************************
+ * In-memory snapshots
+ **************************************/
+
+// The snapshot is a raw copy of the state of the machine, so it's
+// only valid for the same build and ROM. It is meant for run-ahead,
+// rewind and the like, not for storage.
+#define SNAPSHOT_MAGIC  0x53534D47   // "GMSS"
+
+struct snapshot_header
 {
-    static char savename[2048];
-    char *ext;
-
-    strcpy(savename, romname);
-    ext = &savename[strlen(savename)-3];
-    *ext++ = 'g'; *ext++ = 's';
-    *ext++ = '0' + slot;
-    return savename;
-}
+    uint32_t magic;
+    uint32_t size;
+};
 
-void state_poll()
+size_t state_size(void)
 {
-    static const int savekeys[] = {
-        SDL_SCANCODE_0, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, SDL_SCANCODE_4,
-        SDL_SCANCODE_5, SDL_SCANCODE_6, SDL_SCANCODE_7, SDL_SCANCODE_8, SDL_SCANCODE_9
-    };
+    size_t size = sizeof(snapshot_header);
+
+    size += m68k_context_size();
+    size += sizeof(CPU_M68K) + sizeof(CPU_Z80);
+    size += sizeof(VDP) + VRAM_SIZE;
+    size += RAM_SIZE + sizeof(ZRAM) + sizeof(Z80_BANK);
+    size += YM2612GetContextSize();
+    size += IOPORTS_STATE_SIZE;
+    size += sizeof(MASTER_CLOCK) + sizeof(framecounter);
+    size += sizeof(CART_REGS);
+    if (backup_ram_present)
+        size += BACKUP_RAM_SIZE;
+    return size;
+}
+
+#define SAVE(p, var)   do { memcpy((p), &(var), sizeof(var)); (p) += sizeof(var); } while(0)
+#define LOAD(p, var)   do { memcpy(&(var), (p), sizeof(var)); (p) += sizeof(var); } while(0)
 
-    if (keystate[SDL_SCANCODE_LCTRL])
+// A member of the VDP, within its raw copy at p
+#define SNAPSHOT_VDP(p, field)  ((p) + ((const uint8_t*)&VDP.field - (const uint8_t*)&VDP))
+
+void state_save_to(uint8_t *buf)
+{
+    snapshot_header hdr = { SNAPSHOT_MAGIC, (uint32_t)state_size() };
+    uint8_t *p = buf;
+
+    SAVE(p, hdr);
+    p += m68k_get_context(p);
+    SAVE(p, CPU_M68K);
+    SAVE(p, CPU_Z80);
+    SAVE(p, VDP);
+    memcpy(p, VDP.VRAM, VRAM_SIZE);
+    p += VRAM_SIZE;
+    memcpy(p, RAM, RAM_SIZE);
+    p += RAM_SIZE;
+    SAVE(p, ZRAM);
+    SAVE(p, Z80_BANK);
+    p += YM2612SaveContext(p);
+    ioports_save(p);
+    p += IOPORTS_STATE_SIZE;
+    SAVE(p, MASTER_CLOCK);
+    SAVE(p, framecounter);
+    SAVE(p, CART_REGS);
+    if (backup_ram_present)
     {
-        for (int i=0;i<10;i++)
-            if (keyreleased[savekeys[i]])
-                savestate(slotname(i));
+        memcpy(p, BACKUP_RAM, BACKUP_RAM_SIZE);
+        p += BACKUP_RAM_SIZE;
     }
-    else if (keystate[SDL_SCANCODE_LSHIFT])
+
+    assert(p == buf + hdr.size);
+}
+
+bool state_load_from(const uint8_t *buf)
+{
+    snapshot_header hdr;
+    const uint8_t *p = buf;
+
+    LOAD(p, hdr);
+    if (hdr.magic != SNAPSHOT_MAGIC || hdr.size != state_size())
+        return false;
+
+    // The framebuffer belongs to the frontend, and VRAM to the machine:
+    // the snapshot holds their contents, not the pointers
+    uint8_t *screen = VDP._screen;
+    int pitch = VDP._pitch;
+    uint8_t *vram = VDP.VRAM;
+
+    m68k_set_context((void*)p);
+    p += m68k_context_size();
+    LOAD(p, CPU_M68K);
+    LOAD(p, CPU_Z80);
+    gfx_invalidate_changes(p + sizeof(VDP), SNAPSHOT_VDP(p, CRAM), SNAPSHOT_VDP(p, SAT_CACHE));
+    LOAD(p, VDP);
+    VDP.VRAM = vram;
+    memcpy(VDP.VRAM, p, VRAM_SIZE);
+    p += VRAM_SIZE;
+    memcpy(RAM, p, RAM_SIZE);
+    p += RAM_SIZE;
+    LOAD(p, ZRAM);
+    LOAD(p, Z80_BANK);
+    p += YM2612LoadContext(p);
+    ioports_load(p);
+    p += IOPORTS_STATE_SIZE;
+    LOAD(p, MASTER_CLOCK);
+    LOAD(p, framecounter);
+    LOAD(p, CART_REGS);
+    // Run-ahead and rewind load a snapshot every frame: don't touch the
+    // file mapping (and schedule a write back) unless the saves differ
+    if (backup_ram_present)
     {
-        for (int i=0;i<10;i++)
-            if (keyreleased[savekeys[i]])
-                loadstate(slotname(i));
+        if (memcmp(BACKUP_RAM, p, BACKUP_RAM_SIZE) != 0)
+        {
+            memcpy(BACKUP_RAM, p, BACKUP_RAM_SIZE);
+            backup_ram_dirty = true;
+        }
+        p += BACKUP_RAM_SIZE;
     }
+    assert(p == buf + hdr.size);
+
+    VDP._screen = screen;
+    VDP._pitch = pitch;
+
+    // The 68000 view of the Z80 area depends on BUSREQ, and the
+    // cartridge area on the mapper registers
+    mem_z80area(CPU_Z80.get_busreq_line());
+    cartidge_remap();
+    mem_z80bank_update();
+    return true;
 }
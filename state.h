@@ -1,4 +1,13 @@
+#include <stdint.h>
+#include <stddef.h>
 
+// Savestates in Genecyst format
 void savestate(const char *fn);
 bool loadstate(const char *fn);
-void state_poll(void);
+
+// In-memory snapshots of the whole machine, for run-ahead, rewind, etc.
+// The buffer must be state_size() bytes; the size is constant for a
+// given ROM. state_load_from() fails if the snapshot doesn't match.
+size_t state_size(void);
+void state_save_to(uint8_t *buf);
+bool state_load_from(const uint8_t *buf);
@@ -0,0 +1,391 @@
+/*
+ * In-process regression runner.
+ *
+ * Runs all the ROMs listed in a manifest on a pool of threads (each thread
+ * hosts its own Machine), hashes the framebuffer (and optionally the audio
+ * buffer) at the requested frames and compares the hashes against a golden
+ * file. Nothing is written to disk, except the golden file with --update.
+ *
+ * Manifest format, one test per line ('#' starts a comment):
+ *
+ *     <rom> <PAL|NTSC> <frames> [<movie>]
+ *
+ * where <frames> is a comma-separated list of frame numbers or ranges
+ * in the form start:end:step (end excluded), eg: "10,20,1500:18000:250"
+ * (in any order; duplicates are checked once),
+ * and <movie> is an optional input movie (see movie.h) played back from
+ * power-on; it must have been recorded in the same mode.
+ *
+ * Golden file format, one line per checkpoint:
+ *
+ *     <rom> <mode> <frame> <video hash> [<audio hash>]
+ *
+ * where <mode> is PAL or NTSC, followed by "@<movie>" for tests with a movie.
+ */
+#include "../machine.h"
+#include "../libgenemu.h"
+#include "../gfx.h"
+#include "../vdp.h"
+#include "../movie.h"
+#include "../ezOptionParser.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Checkpoint
+{
+    int frame;
+    uint64_t video;
+    uint64_t audio;
+};
+
+struct Test
+{
+    std::string rom;
+    std::string mode;
+    std::string movie;
+    std::vector<Checkpoint> checkpoints;
+    bool loaded;
+    double seconds;
+};
+
+// FNV-1a
+static uint64_t hash(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (size--)
+    {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool checkpoint_before(const Checkpoint &a, const Checkpoint &b)
+{
+    return a.frame < b.frame;
+}
+
+static bool checkpoint_same(const Checkpoint &a, const Checkpoint &b)
+{
+    return a.frame == b.frame;
+}
+
+static bool parse_frames(const char *spec, std::vector<Checkpoint> &out)
+{
+    std::string s(spec);
+    size_t pos = 0;
+
+    while (pos < s.size())
+    {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos)
+            comma = s.size();
+        std::string item = s.substr(pos, comma-pos);
+        pos = comma+1;
+
+        int start, end, step = 1;
+        int n = sscanf(item.c_str(), "%d:%d:%d", &start, &end, &step);
+        if (n == 1)
+            end = start+1;
+        else if (n < 2 || step <= 0)
+            return false;
+        if (start < 0)
+            return false;
+
+        for (int f=start; f<end; f+=step)
+        {
+            Checkpoint cp = { f, 0, 0 };
+            out.push_back(cp);
+        }
+    }
+
+    // Tests only run forward: check the frames in order, once each
+    std::sort(out.begin(), out.end(), checkpoint_before);
+    out.erase(std::unique(out.begin(), out.end(), checkpoint_same), out.end());
+    return !out.empty();
+}
+
+static bool load_manifest(const char *fn, std::vector<Test> &tests)
+{
+    FILE *f = fopen(fn, "r");
+    if (!f)
+    {
+        fprintf(stderr, "ERROR: cannot open manifest %s\n", fn);
+        return false;
+    }
+
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        ++lineno;
+        if (char *comment = strchr(line, '#'))
+            *comment = 0;
+
+        char rom[2048], mode[16], frames[2048], movie[2048];
+        int n = sscanf(line, "%2047s %15s %2047s %2047s", rom, mode, frames, movie);
+        if (n <= 0)
+            continue;
+
+        Test t;
+        t.rom = rom;
+        t.mode = mode;
+        if (n == 4)
+            t.movie = movie;
+        t.loaded = false;
+        t.seconds = 0;
+        if (n < 3 || (t.mode != "PAL" && t.mode != "NTSC") || !parse_frames(frames, t.checkpoints))
+        {
+            fprintf(stderr, "ERROR: %s:%d: invalid test\n", fn, lineno);
+            fclose(f);
+            return false;
+        }
+        tests.push_back(t);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// Mode as written in the golden file and in the report
+static std::string test_mode(const Test &t)
+{
+    return t.movie.empty() ? t.mode : t.mode + "@" + t.movie;
+}
+
+static std::string golden_key(const std::string &rom, const std::string &mode, int frame)
+{
+    char buf[32];
+    sprintf(buf, " %d", frame);
+    return rom + " " + mode + buf;
+}
+
+static bool load_golden(const char *fn, std::map<std::string, Checkpoint> &golden)
+{
+    FILE *f = fopen(fn, "r");
+    if (!f)
+        return false;
+
+    char line[4096];
+    while (fgets(line, sizeof(line), f))
+    {
+        char rom[2048], mode[2048];
+        Checkpoint cp = { 0, 0, 0 };
+        unsigned long long video, audio = 0;
+
+        if (sscanf(line, "%2047s %2047s %d %llx %llx", rom, mode, &cp.frame, &video, &audio) < 4)
+            continue;
+        cp.video = video;
+        cp.audio = audio;
+        golden[golden_key(rom, mode, cp.frame)] = cp;
+    }
+
+    fclose(f);
+    return true;
+}
+
+static void run_test(Test &t, bool hash_audio)
+{
+    static MACHINE_LOCAL uint8_t screen[GENEMU_SCREEN_WIDTH*GENEMU_SCREEN_HEIGHT*4];
+    static MACHINE_LOCAL int16_t audio[(YM2612_FREQ/50 + 1) * 2];
+
+    double start = now();
+    Machine machine;
+
+    if (!machine.load_rom(t.rom.c_str()))
+        return;
+    machine.set_pal(t.mode == "PAL");
+    if (!t.movie.empty())
+    {
+        // The movie selects its own mode, which must match the test
+        if (!movie_play(t.movie.c_str()) || machine.pal() != (t.mode == "PAL"))
+            return;
+    }
+    t.loaded = true;
+    gfx_enable(true);
+
+    // Audio is always rendered (it keeps the YM2612 timers running),
+    // it's just not hashed unless requested.
+    int nsamples = YM2612_FREQ / (machine.pal() ? 50 : 60);
+    for (size_t i=0; i<t.checkpoints.size(); ++i)
+    {
+        Checkpoint &cp = t.checkpoints[i];
+
+        while (machine.frame() <= cp.frame)
+        {
+            movie_frame();
+            machine.run_frame(screen, GENEMU_SCREEN_WIDTH*4, audio, nsamples);
+        }
+
+        cp.video = hash(screen, sizeof(screen));
+        if (hash_audio)
+            cp.audio = hash(audio, nsamples*2*sizeof(int16_t));
+    }
+
+    t.seconds = now() - start;
+}
+
+int main(int argc, const char *argv[])
+{
+    ez::ezOptionParser opt;
+
+    opt.overview = "GenEmu -- regression runner";
+    opt.syntax = "genemu-regress [OPTIONS] manifest";
+    opt.add("",0,0,0,"Display usage instructions.", "-h", "--help");
+    opt.add("",0,1,0,"Golden hashes file [default: manifest + .golden]", "--golden");
+    opt.add("",0,0,0,"Write the golden file with the current results", "--update");
+    opt.add("",0,0,0,"Hash the audio buffer too", "--audio");
+    opt.add("",0,1,0,"Number of worker threads [default: number of CPUs]", "-j", "--jobs");
+
+    opt.parse(argc, argv);
+    if (opt.isSet("-h"))
+    {
+        std::string usage;
+        opt.getUsage(usage, 120);
+        std::cout << usage;
+        return 0;
+    }
+
+    std::string manifest;
+    if (opt.firstArgs.size() >= 2)
+        manifest = *opt.firstArgs[1];
+    else if (opt.lastArgs.size() >= 1)
+        manifest = *opt.lastArgs[0];
+    else
+    {
+        std::cerr << "ERROR: no manifest specified\n";
+        return 2;
+    }
+
+    std::string golden_fn = manifest + ".golden";
+    if (opt.isSet("--golden"))
+        opt.get("--golden")->getString(golden_fn);
+    bool update = opt.isSet("--update");
+    bool hash_audio = opt.isSet("--audio");
+
+    int jobs = std::thread::hardware_concurrency();
+    if (opt.isSet("-j"))
+        opt.get("-j")->getInt(jobs);
+    if (jobs <= 0)
+        jobs = 1;
+
+    std::vector<Test> tests;
+    if (!load_manifest(manifest.c_str(), tests))
+        return 2;
+
+    std::map<std::string, Checkpoint> golden;
+    if (!update && !load_golden(golden_fn.c_str(), golden))
+    {
+        fprintf(stderr, "ERROR: cannot open golden file %s (use --update to create it)\n", golden_fn.c_str());
+        return 2;
+    }
+
+    double start = now();
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int i=0; i<jobs && i<(int)tests.size(); ++i)
+    {
+        workers.push_back(std::thread([&]() {
+            size_t idx;
+            while ((idx = next++) < tests.size())
+                run_test(tests[idx], hash_audio);
+        }));
+    }
+    for (size_t i=0; i<workers.size(); ++i)
+        workers[i].join();
+    double elapsed = now() - start;
+
+    int failed = 0, checked = 0, missing = 0;
+    FILE *out = NULL;
+    if (update)
+    {
+        out = fopen(golden_fn.c_str(), "w");
+        if (!out)
+        {
+            fprintf(stderr, "ERROR: cannot write golden file %s\n", golden_fn.c_str());
+            return 2;
+        }
+    }
+
+    for (size_t i=0; i<tests.size(); ++i)
+    {
+        const Test &t = tests[i];
+        std::string mode = test_mode(t);
+        int test_failed = 0;
+
+        if (!t.loaded)
+        {
+            printf("FAIL  %s (%s): cannot load ROM or movie\n", t.rom.c_str(), mode.c_str());
+            ++failed;
+            continue;
+        }
+
+        for (size_t j=0; j<t.checkpoints.size(); ++j)
+        {
+            const Checkpoint &cp = t.checkpoints[j];
+
+            if (out)
+            {
+                fprintf(out, "%s %s %d %016llx", t.rom.c_str(), mode.c_str(), cp.frame, (unsigned long long)cp.video);
+                if (hash_audio)
+                    fprintf(out, " %016llx", (unsigned long long)cp.audio);
+                fprintf(out, "\n");
+                continue;
+            }
+
+            std::map<std::string, Checkpoint>::iterator g = golden.find(golden_key(t.rom, mode, cp.frame));
+            if (g == golden.end())
+            {
+                printf("  %s (%s) frame %d: no golden hash\n", t.rom.c_str(), mode.c_str(), cp.frame);
+                ++missing;
+                continue;
+            }
+
+            ++checked;
+            if (g->second.video != cp.video)
+            {
+                printf("  %s (%s) frame %d: video %016llx, expected %016llx\n", t.rom.c_str(), mode.c_str(),
+                    cp.frame, (unsigned long long)cp.video, (unsigned long long)g->second.video);
+                ++test_failed;
+            }
+            if (hash_audio && g->second.audio != cp.audio)
+            {
+                printf("  %s (%s) frame %d: audio %016llx, expected %016llx\n", t.rom.c_str(), mode.c_str(),
+                    cp.frame, (unsigned long long)cp.audio, (unsigned long long)g->second.audio);
+                ++test_failed;
+            }
+        }
+
+        if (!out)
+            printf("%s  %s (%s) %.2f s\n", test_failed ? "FAIL" : "ok  ", t.rom.c_str(), mode.c_str(), t.seconds);
+        if (test_failed)
+            ++failed;
+    }
+
+    if (out)
+    {
+        fclose(out);
+        printf("Written %s (%d tests, %.2f s)\n", golden_fn.c_str(), (int)tests.size(), elapsed);
+    }
+    else
+        printf("%d tests, %d checkpoints, %d failed, %d missing (%.2f s, %d threads)\n",
+            (int)tests.size(), checked, failed, missing, elapsed, (int)workers.size());
+
+    return (failed || missing) ? 1 : 0;
+}
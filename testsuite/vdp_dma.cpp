@@ -0,0 +1,202 @@
+/*
+ * VDP DMA checks that don't need a ROM: the console runs an empty
+ * cartridge, and the VDP is driven directly through its ports. The
+ * block paths of the transfers are compared against a byte-by-byte
+ * model of the hardware, like the generic loops in vdp.cpp.
+ */
+#include "../machine.h"
+#include "../vdp.h"
+#include "../gfx.h"
+extern "C" {
+    #include "../m68k/m68k.h"
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int failures;
+
+#define CHECK(cond, ...) \
+    do { if (!(cond)) { fprintf(stderr, "FAIL  " __VA_ARGS__); ++failures; } } while (0)
+
+static void vdp_reg(int reg, int value)
+{
+    vdp_mem_w16(0xC00004, 0x8000 | (reg << 8) | (value & 0xFF));
+}
+
+static void vdp_command(int code, int address)
+{
+    vdp_mem_w16(0xC00004, ((code & 3) << 14) | (address & 0x3FFF));
+    vdp_mem_w16(0xC00004, ((code >> 2) << 4) | (address >> 14));
+}
+
+static void vram_read(uint8_t *vram)
+{
+    vdp_reg(15, 2);
+    vdp_command(0x00, 0x0000);
+    for (int addr = 0; addr < 0x10000; addr += 2)
+    {
+        uint16_t value = vdp_mem_r16(0xC00000);
+        vram[addr] = value >> 8;
+        vram[addr+1] = value & 0xFF;
+    }
+}
+
+static void vram_check(const char *name, const uint8_t *expected)
+{
+    static uint8_t vram[0x10000];
+
+    vram_read(vram);
+    for (int addr = 0; addr < 0x10000; ++addr)
+        if (vram[addr] != expected[addr])
+        {
+            CHECK(false, "%s: VRAM %04x = %02x, expected %02x\n", name, addr, vram[addr], expected[addr]);
+            return;
+        }
+}
+
+// VRAM copy of length bytes from src to dst
+static void test_copy(const char *name, int src, int dst, int length)
+{
+    static uint8_t expected[0x10000];
+
+    vram_read(expected);
+    for (int i = 0; i < length; ++i)
+        expected[((dst + i) ^ 1) & 0xFFFF] = expected[((src + i) & 0xFFFF) ^ 1];
+
+    vdp_reg(15, 1);
+    vdp_reg(19, length);
+    vdp_reg(20, length >> 8);
+    vdp_reg(21, src);
+    vdp_reg(22, src >> 8);
+    vdp_reg(23, 0xC0);      // copy
+    vdp_command(0x30, dst);
+    vram_check(name, expected);
+}
+
+// VRAM fill of length bytes, started by a data port write at addr
+static void test_fill(const char *name, int addr, int increment, int length, uint16_t value)
+{
+    static uint8_t expected[0x10000];
+
+    vram_read(expected);
+    expected[addr] = value >> 8;
+    expected[addr ^ 1] = value & 0xFF;
+    for (int i = 0; i < length; ++i)
+        expected[((addr + (i+1)*increment) ^ 1) & 0xFFFF] = value >> 8;
+
+    vdp_reg(15, increment);
+    vdp_reg(19, length);
+    vdp_reg(20, length >> 8);
+    vdp_reg(23, 0x80);      // fill
+    vdp_command(0x21, addr);
+    vdp_mem_w16(0xC00000, value);
+    vram_check(name, expected);
+}
+
+// 68000 to VRAM transfer of length words from src (in the 128KB window)
+static void test_m68k(const char *name, uint32_t src, int dst, int length)
+{
+    static uint8_t expected[0x10000];
+
+    vram_read(expected);
+    for (int i = 0; i < length; ++i)
+    {
+        uint32_t addr = (src & 0xFE0000) | ((src + i*2) & 0x1FFFF);
+        uint16_t value = m68k_read_memory_16(addr);
+        expected[(dst + i*2) & 0xFFFF] = value >> 8;
+        expected[((dst + i*2) ^ 1) & 0xFFFF] = value & 0xFF;
+    }
+
+    vdp_reg(15, 2);
+    vdp_reg(19, length);
+    vdp_reg(20, length >> 8);
+    vdp_reg(21, src >> 1);
+    vdp_reg(22, src >> 9);
+    vdp_reg(23, (src >> 17) & 0x7F);
+    vdp_command(0x21, dst);
+    vram_check(name, expected);
+}
+
+// Fill the whole VRAM with increment 2: the last byte written is 0xFFFF.
+// The data port write that starts the fill goes to 0xFFFE, and moves the
+// address to 0, where the fill begins.
+static void test_fill_stride2(void)
+{
+    vdp_reg(1, 0x14);       // DMA enable
+    vdp_reg(15, 2);
+    vdp_reg(19, 0x00);      // 0x8000 bytes
+    vdp_reg(20, 0x80);
+    vdp_reg(23, 0x80);      // fill
+    memset(GFX_DIRTY_PATTERNS, 0, sizeof(GFX_DIRTY_PATTERNS));
+
+    vdp_command(0x21, 0xFFFE);
+    vdp_mem_w16(0xC00000, 0xAB00);
+
+    vdp_command(0x00, 0x0000);
+    for (int addr = 0; addr < 0x10000; addr += 2)
+    {
+        uint16_t value = vdp_mem_r16(0xC00000);
+        uint16_t expected = addr == 0xFFFE ? 0xABAB : 0x00AB;
+        if (value != expected)
+        {
+            CHECK(false, "stride-2 fill: VRAM %04x = %04x, expected %04x\n", addr, value, expected);
+            break;
+        }
+    }
+
+    for (int i = 0; i < 0x800/32; ++i)
+        CHECK(GFX_DIRTY_PATTERNS[i] == 0xFFFFFFFF, "stride-2 fill: patterns %d-%d not dirty\n", i*32, i*32+31);
+}
+
+int main(void)
+{
+    char rom[] = "/tmp/genemu-vdp-dma-XXXXXX";
+    int fd = mkstemp(rom);
+    if (fd < 0 || ftruncate(fd, 0x20000) < 0)
+    {
+        fprintf(stderr, "ERROR: cannot create %s\n", rom);
+        return 1;
+    }
+    close(fd);
+
+    Machine machine;
+    bool loaded = machine.load_rom(rom);
+    unlink(rom);
+    if (!loaded)
+        return 1;
+
+    // Start from a consistent point of the scheduler
+    static int16_t audio[2048];
+    machine.run_frame(NULL, 0, audio, YM2612_FREQ / 60);
+
+    test_fill_stride2();
+
+    // Recognizable contents for the copies, in VRAM and in 68000 RAM
+    srand(1);
+    vdp_reg(15, 2);
+    vdp_command(0x01, 0x0000);
+    for (int addr = 0; addr < 0x10000; addr += 2)
+        vdp_mem_w16(0xC00000, rand());
+    for (int addr = 0; addr < 0x10000; addr += 2)
+        m68k_write_memory_16(0xFF0000 + addr, rand());
+
+    // The destination overlaps the source and repeats its first bytes
+    test_copy("copy dst=src+2", 0x1000, 0x1002, 0x101);
+    test_copy("copy dst=src+4", 0x2001, 0x2005, 0x200);
+    test_copy("copy dst=src-3", 0x2803, 0x2800, 0x123);
+    test_copy("copy odd parity", 0x3000, 0x3801, 0x80);
+
+    test_fill("fill odd start", 0x4000, 1, 0x81, 0x5AA5);
+    test_fill("fill even start", 0x4400, 1, 0x80, 0x1234);
+
+    test_m68k("68000 RAM", 0xFF8000, 0x5000, 0x400);
+    test_m68k("68000 RAM wrapping", 0xFFFF00, 0x6000, 0x100);
+    test_m68k("68000 ROM", 0x000100, 0x7000, 0x80);
+
+    if (failures)
+        return 1;
+    printf("vdp_dma: OK\n");
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Trace decoder: turns a binary trace written by genemu --trace into text.
+ *
+ *     genemu-tracedump genemu.trace [output.txt]
+ */
+#include "../trace.h"
+#include <stdio.h>
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: genemu-tracedump tracefile [output]\n");
+        return 2;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        fprintf(stderr, "ERROR: cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (argc == 3 && !(out = fopen(argv[2], "w")))
+    {
+        fprintf(stderr, "ERROR: cannot create %s\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    bool ok = trace_decode(in, out);
+    if (!ok)
+        fprintf(stderr, "ERROR: %s is not a valid trace file\n", argv[1]);
+
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+#include "trace.h"
+#include "cpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Trace file format (host byte order):
+ *
+ *   "GTRC", uint32 version, uint32 number of strings, uint32 number of events
+ *   strings: uint16 length, characters (referenced by their index)
+ *   events:  uint64 clock, uint32 pc, int32 frame, uint8 category, uint8 cpu,
+ *            uint8 number of arguments, uint8 0, uint32 format string index,
+ *            uint64 arguments[]
+ *
+ * Arguments of %s conversions are stored as string indices.
+ */
+
+#define TRACE_VERSION   1
+
+extern MACHINE_LOCAL int activecpu;
+extern MACHINE_LOCAL int framecounter;
+
+static const char *trace_names[TRACE_NUM] = {
+    "M68K", "MEM", "VDP", "DMA", "Z80", "IOPORTS", "CARTIDGE", "GFX", "PSG", "YM2612"
+};
+
+struct trace_entry
+{
+    uint64_t clock;
+    const char *fmt;
+    uint32_t pc;
+    int32_t frame;
+    uint8_t cat, cpu, nargs;
+    uint64_t args[TRACE_MAX_ARGS];
+};
+
+MACHINE_LOCAL uint32_t trace_mask;
+static MACHINE_LOCAL trace_entry *trace_ring;
+static MACHINE_LOCAL uint32_t trace_size;       // power of two
+static MACHINE_LOCAL uint64_t trace_count;      // events recorded so far
+
+void trace_enable(uint32_t mask, int nevents)
+{
+    trace_disable();
+
+    trace_size = 1;
+    while (trace_size < (uint32_t)nevents)
+        trace_size <<= 1;
+    trace_ring = (trace_entry*)malloc(trace_size * sizeof(trace_entry));
+    trace_count = 0;
+    trace_mask = mask;
+}
+
+void trace_disable(void)
+{
+    free(trace_ring);
+    trace_ring = NULL;
+    trace_mask = 0;
+}
+
+bool trace_parse(const char *list, uint32_t *mask)
+{
+    *mask = 0;
+    while (*list)
+    {
+        size_t len = strcspn(list, ",");
+        if (len == 3 && strncasecmp(list, "all", 3) == 0)
+            *mask = (1u << TRACE_NUM) - 1;
+        else
+        {
+            int i;
+            for (i=0; i<TRACE_NUM; ++i)
+                if (strlen(trace_names[i]) == len && strncasecmp(list, trace_names[i], len) == 0)
+                    break;
+            if (i == TRACE_NUM)
+                return false;
+            *mask |= 1u << i;
+        }
+        list += len;
+        if (*list == ',')
+            ++list;
+    }
+    return true;
+}
+
+void trace_event(int cat, const char *fmt, int nargs, const uint64_t *args)
+{
+    trace_entry &e = trace_ring[trace_count++ & (trace_size-1)];
+
+    e.cpu = activecpu;
+    if (activecpu == 0)
+    {
+        e.clock = CPU_M68K.clock();
+        e.pc = CPU_M68K.PPC();
+    }
+    else
+    {
+        e.clock = CPU_Z80.clock();
+        e.pc = CPU_Z80.PC();
+    }
+    e.frame = framecounter;
+    e.cat = cat;
+    e.fmt = fmt;
+    e.nargs = nargs;
+    memcpy(e.args, args, nargs * sizeof(uint64_t));
+}
+
+/**************************************
+ * Format strings
+ **************************************/
+
+enum { LEN_NONE, LEN_HH, LEN_H, LEN_L };
+
+struct conversion
+{
+    std::string spec;   // without the length modifier
+    char type;
+    int length;
+};
+
+// Parse the conversion starting at p (on the '%'); returns the
+// pointer past its end.
+static const char *parse_conversion(const char *p, conversion *c)
+{
+    const char *start = p++;
+
+    while (*p && strchr("-+ #0", *p)) ++p;
+    while (*p >= '0' && *p <= '9') ++p;
+    if (*p == '.')
+        for (++p; *p >= '0' && *p <= '9'; ++p) {}
+    c->spec.assign(start, p - start);
+
+    c->length = LEN_NONE;
+    if (*p == 'h')
+    {
+        c->length = (p[1] == 'h') ? LEN_HH : LEN_H;
+        p += (p[1] == 'h') ? 2 : 1;
+    }
+    else
+        while (*p == 'l' || *p == 'z' || *p == 'j')
+            c->length = LEN_L, ++p;
+
+    c->type = *p ? *p++ : '%';
+    return p;
+}
+
+static void format_event(FILE *out, const char *fmt, int nargs, const uint64_t *args,
+    const std::vector<std::string> &strings)
+{
+    int n = 0;
+
+    while (*fmt)
+    {
+        if (*fmt != '%')
+        {
+            fputc(*fmt++, out);
+            continue;
+        }
+
+        conversion c;
+        fmt = parse_conversion(fmt, &c);
+        if (c.type == '%')
+        {
+            fputc('%', out);
+            continue;
+        }
+        if (n >= nargs)
+        {
+            fputs("<?>", out);
+            continue;
+        }
+
+        uint64_t arg = args[n++];
+        std::string spec = c.spec;
+        switch (c.type)
+        {
+        case 'd': case 'i':
+        {
+            long long v = (c.length == LEN_L) ? (long long)arg :
+                          (c.length == LEN_H) ? (short)arg :
+                          (c.length == LEN_HH) ? (signed char)arg : (int)arg;
+            fprintf(out, (spec + "ll" + c.type).c_str(), v);
+            break;
+        }
+        case 'u': case 'x': case 'X': case 'o':
+        {
+            unsigned long long v = (c.length == LEN_L) ? arg :
+                                   (c.length == LEN_H) ? (unsigned short)arg :
+                                   (c.length == LEN_HH) ? (unsigned char)arg : (unsigned int)arg;
+            fprintf(out, (spec + "ll" + c.type).c_str(), v);
+            break;
+        }
+        case 'c':
+            fprintf(out, (spec + 'c').c_str(), (int)arg);
+            break;
+        case 's':
+            fprintf(out, (spec + 's').c_str(), arg < strings.size() ? strings[arg].c_str() : "<?>");
+            break;
+        default:
+            fprintf(out, "<%%%c?>", c.type);
+            break;
+        }
+    }
+}
+
+/**************************************
+ * Trace files
+ **************************************/
+
+static void put(FILE *f, const void *data, size_t size)
+{
+    fwrite(data, 1, size, f);
+}
+
+static bool get(FILE *f, void *data, size_t size)
+{
+    return fread(data, 1, size, f) == size;
+}
+
+bool trace_dump(const char *fn)
+{
+    std::map<const char*, uint32_t> ids;
+    std::vector<const char*> strings;
+    uint64_t first = trace_count > trace_size ? trace_count - trace_size : 0;
+
+    if (!trace_ring)
+        return false;
+
+    FILE *f = fopen(fn, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "ERROR: cannot create trace file %s\n", fn);
+        return false;
+    }
+
+    // Intern the strings (format strings and %s arguments) first
+    for (uint64_t i=first; i<trace_count; ++i)
+    {
+        const trace_entry &e = trace_ring[i & (trace_size-1)];
+        const char *strs[TRACE_MAX_ARGS+1];
+        int nstrs = 0;
+
+        strs[nstrs++] = e.fmt;
+        int n = 0;
+        for (const char *p = e.fmt; *p; )
+        {
+            if (*p != '%') { ++p; continue; }
+            conversion c;
+            p = parse_conversion(p, &c);
+            if (c.type == '%')
+                continue;
+            if (c.type == 's' && n < e.nargs)
+                strs[nstrs++] = (const char*)e.args[n];
+            ++n;
+        }
+
+        for (int j=0; j<nstrs; ++j)
+            if (ids.insert(std::make_pair(strs[j], (uint32_t)strings.size())).second)
+                strings.push_back(strs[j]);
+    }
+
+    uint32_t nstrings = strings.size();
+    uint32_t nevents = trace_count - first;
+    uint32_t version = TRACE_VERSION;
+    put(f, "GTRC", 4);
+    put(f, &version, 4);
+    put(f, &nstrings, 4);
+    put(f, &nevents, 4);
+
+    for (uint32_t i=0; i<nstrings; ++i)
+    {
+        uint16_t len = strlen(strings[i]);
+        put(f, &len, 2);
+        put(f, strings[i], len);
+    }
+
+    for (uint64_t i=first; i<trace_count; ++i)
+    {
+        const trace_entry &e = trace_ring[i & (trace_size-1)];
+        uint8_t hdr[4] = { e.cat, e.cpu, e.nargs, 0 };
+        uint32_t fmt = ids[e.fmt];
+        uint64_t a[TRACE_MAX_ARGS];
+
+        memcpy(a, e.args, sizeof(a));
+        int n = 0;
+        for (const char *p = e.fmt; *p; )
+        {
+            if (*p != '%') { ++p; continue; }
+            conversion c;
+            p = parse_conversion(p, &c);
+            if (c.type == '%')
+                continue;
+            if (c.type == 's' && n < e.nargs)
+                a[n] = ids[(const char*)e.args[n]];
+            ++n;
+        }
+
+        put(f, &e.clock, 8);
+        put(f, &e.pc, 4);
+        put(f, &e.frame, 4);
+        put(f, hdr, 4);
+        put(f, &fmt, 4);
+        put(f, a, e.nargs * 8);
+    }
+
+    fclose(f);
+    return true;
+}
+
+bool trace_decode(FILE *in, FILE *out)
+{
+    char magic[4];
+    uint32_t version, nstrings, nevents;
+
+    if (!get(in, magic, 4) || memcmp(magic, "GTRC", 4) != 0 ||
+        !get(in, &version, 4) || version != TRACE_VERSION ||
+        !get(in, &nstrings, 4) || !get(in, &nevents, 4))
+        return false;
+
+    std::vector<std::string> strings(nstrings);
+    for (uint32_t i=0; i<nstrings; ++i)
+    {
+        uint16_t len;
+        if (!get(in, &len, 2))
+            return false;
+        strings[i].resize(len);
+        if (len && !get(in, &strings[i][0], len))
+            return false;
+    }
+
+    for (uint32_t i=0; i<nevents; ++i)
+    {
+        uint64_t clock, args[TRACE_MAX_ARGS];
+        uint32_t pc, fmt;
+        int32_t frame;
+        uint8_t hdr[4];
+
+        if (!get(in, &clock, 8) || !get(in, &pc, 4) || !get(in, &frame, 4) ||
+            !get(in, hdr, 4) || !get(in, &fmt, 4) ||
+            hdr[0] >= TRACE_NUM || hdr[2] > TRACE_MAX_ARGS || fmt >= nstrings ||
+            !get(in, args, hdr[2] * 8))
+            return false;
+
+        fprintf(out, "%12llu [%s][%cPC=%06x](%04d) ", (unsigned long long)clock,
+            trace_names[hdr[0]], hdr[1] ? 'Z' : 'M', pc, frame);
+        format_event(out, strings[fmt].c_str(), hdr[2], args, strings);
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "machine.h"
+
+// Trace categories, enabled at runtime
+enum
+{
+    TRACE_M68K,
+    TRACE_MEM,
+    TRACE_VDP,
+    TRACE_DMA,
+    TRACE_Z80,
+    TRACE_IOPORTS,
+    TRACE_CARTIDGE,
+    TRACE_GFX,
+    TRACE_PSG,
+    TRACE_YM2612,
+
+    TRACE_NUM
+};
+
+#define TRACE_MAX_ARGS   8
+
+extern MACHINE_LOCAL uint32_t trace_mask;
+
+// Start recording the categories in mask (a bitmask of 1<<TRACE_*) into
+// a ring buffer of nevents entries, where the oldest events are dropped.
+void trace_enable(uint32_t mask, int nevents);
+void trace_disable(void);
+
+// Parse a comma-separated list of category names (or "all") into a mask.
+// Returns false on unknown names.
+bool trace_parse(const char *list, uint32_t *mask);
+
+// Write the recorded events to a binary trace file
+bool trace_dump(const char *fn);
+
+// Turn a binary trace file into text (see genemu-tracedump)
+bool trace_decode(FILE *in, FILE *out);
+
+void trace_event(int cat, const char *fmt, int nargs, const uint64_t *args);
+
+template<typename... Args>
+inline void trace_record(int cat, const char *fmt, Args... args)
+{
+    static_assert(sizeof...(args) <= TRACE_MAX_ARGS, "too many trace arguments");
+    const uint64_t a[sizeof...(args) + 1] = { (uint64_t)args... };
+    trace_event(cat, fmt, sizeof...(args), a);
+}
+
+// Record an event with the current CPU, PC, clock and frame. Nothing is
+// formatted at runtime: fmt is a printf format string with integer
+// arguments (%s only for string literals), that is used by the decoder.
+// Costs a single branch when the category is disabled.
+#define TRACE(cat, ...) \
+    do { if (__builtin_expect(trace_mask & (1u << (cat)), 0)) trace_record((cat), __VA_ARGS__); } while(0)
+
+#endif
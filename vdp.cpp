@@ -1,15 +1,20 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <assert.h>
+#include <string.h>
+#include <stdlib.h>
 #include "vdp.h"
 #include "gfx.h"
 #include "mem.h"
 #include "cpu.h"
+#include "sched.h"
+#include "prof.h"
+#include "trace.h"
 extern "C" {
     #include "m68k/m68k.h"
 }
-extern int framecounter;
-extern int VERSION_PAL;
+extern MACHINE_LOCAL int framecounter;
+extern MACHINE_LOCAL int VERSION_PAL;
 
 #define REG0_HVLATCH          BIT(regs[0], 1)
 #define REG0_LINE_INTERRUPT   BIT(regs[0], 4)
@@ -30,12 +35,12 @@ extern int VERSION_PAL;
 #define REG23_DMA_SRCADDR_HIGH ((regs[23] & 0x7F) << 16)
 #define REG23_DMA_TYPE        BITS(regs[23], 6, 2)
 
-class VDP VDP;
+MACHINE_LOCAL class VDP VDP;
 
 // Return 9-bit accurate hcounter
 int VDP::hcounter(void)
 {
-    int mclk = m68k_cycles_run() * M68K_FREQ_DIVISOR;
+    int mclk = MAX((int64_t)(sched_clock() - _line_clock), 0);
     int pixclk;
 
     // Accurate 9-bit hcounter emulation, from timing posted here:
@@ -91,7 +96,7 @@ void VDP::register_w(int reg, uint8_t value)
     if (!BIT(regs[0x1], 2) && reg > 0xA) return;
 
     regs[reg] = value;
-    mem_log("VDP", "reg:%02d <- %02x\n", reg, value);
+    TRACE(TRACE_VDP, "reg:%02d <- %02x\n", reg, value);
 
     // Writing a register clear the first command word
     // (see sonic3d intro wrong colors, and vdpfifotesting)
@@ -110,6 +115,13 @@ void VDP::register_w(int reg, uint8_t value)
             }
             else if (!REG0_HVLATCH && hvcounter_latched)
                 hvcounter_latched = false;
+            sched_vdp_changed();
+            break;
+
+        case 1:
+        case 10:
+            // Interrupt generation might have changed
+            sched_vdp_changed();
             break;
     }
 
@@ -127,11 +139,31 @@ void VDP::push_fifo(uint16_t value)
 void VDP::VRAM_W(uint16_t address, uint8_t value)
 {
     VRAM[address] = value;
+    GFX_DIRTY_PATTERNS[address >> 10] |= 1u << ((address >> 5) & 31);
 
     // Update internal SAT cache if it was modified
     // This cache is needed for Castlevania Bloodlines (level 6-2)
     if (address >= REG5_SAT_ADDRESS && address_reg < REG5_SAT_ADDRESS + REG5_SAT_SIZE)
+    {
         SAT_CACHE[address - REG5_SAT_ADDRESS] = value;
+        GFX_DIRTY_SAT = true;
+    }
+}
+
+// Same as VRAM_W for a block of bytes (start, start+step, ... up to end)
+// that was written directly into VRAM
+void VDP::sat_cache_update(int start, int end, int step)
+{
+    int sat = REG5_SAT_ADDRESS;
+
+    end = MIN(end, sat + REG5_SAT_SIZE);
+    if (start < sat)
+        start += (sat - start + step - 1) / step * step;
+    for (int address = start; address < end; address += step)
+    {
+        SAT_CACHE[address - sat] = VRAM[address];
+        GFX_DIRTY_SAT = true;
+    }
 }
 
 
@@ -144,20 +176,21 @@ void VDP::data_port_w16(uint16_t value)
     switch (code_reg & 0xF)
     {
     case 0x1:
-        mem_log("VDP", "Direct VRAM write: addr:%x increment:%d value:%04x A0=%x vc:%x hc:%x\n",
+        TRACE(TRACE_VDP, "Direct VRAM write: addr:%x increment:%d value:%04x A0=%x vc:%x hc:%x\n",
                 address_reg, REG15_DMA_INCREMENT, value, m68k_get_reg(NULL, M68K_REG_A0), vcounter(), hcounter());
         VRAM_W((address_reg    ) & 0xFFFF, value >> 8);
         VRAM_W((address_reg ^ 1) & 0xFFFF, value & 0xFF);
         address_reg += REG15_DMA_INCREMENT;
         break;
     case 0x3:
-        mem_log("VDP", "Direct CRAM write: addr:%x increment:%d value:%04x vc:%x hc:%x\n",
+        TRACE(TRACE_VDP, "Direct CRAM write: addr:%x increment:%d value:%04x vc:%x hc:%x\n",
                 address_reg, REG15_DMA_INCREMENT, value, vcounter(), hcounter());
         CRAM[(address_reg >> 1) & 0x3F] = value;
+        GFX_DIRTY_CRAM = true;
         address_reg += REG15_DMA_INCREMENT;
         break;
     case 0x5:
-        mem_log("VDP", "Direct VSRAM write: addr:%x increment:%d value:%04x vc:%x hc:%x\n",
+        TRACE(TRACE_VDP, "Direct VSRAM write: addr:%x increment:%d value:%04x vc:%x hc:%x\n",
                 address_reg, REG15_DMA_INCREMENT, value, vcounter(), hcounter());
         VSRAM[(address_reg >> 1) & 0x3F] = value;
         address_reg += REG15_DMA_INCREMENT;
@@ -194,7 +227,7 @@ uint16_t VDP::data_port_r16(void)
     uint16_t value;
 
     command_word_pending = false;
-    mem_log("VDP", "data port r16: code:%x, addr:%x\n", code_reg, address_reg);
+    TRACE(TRACE_VDP, "data port r16: code:%x, addr:%x\n", code_reg, address_reg);
 
     switch (code_reg & 0xF)
     {
@@ -231,7 +264,7 @@ uint16_t VDP::data_port_r16(void)
         return value;
 
     default:
-        fprintf(stderr, "[VDP][PC=%06x](%04d) invalid data port write16: code:%02x\n", m68k_get_reg(NULL, M68K_REG_PC), framecounter, code_reg);
+        mem_err("VDP", "invalid data port read16: code:%02x\n", code_reg);
         assert(!"data port r not handled");
         return 0xFF;
     }
@@ -249,7 +282,7 @@ void VDP::control_port_w(uint16_t value)
         address_reg &= 0x3FFF;
         address_reg |= value << 14;
         command_word_pending = false;
-        fprintf(stdout, "[VDP][PC=%06x](%04d) command word 2nd: code:%02x addr:%04x\n", m68k_get_reg(NULL, M68K_REG_PC), framecounter, code_reg, address_reg);
+        TRACE(TRACE_VDP, "command word 2nd: code:%02x addr:%04x\n", code_reg, address_reg);
         if (code_reg & (1<<5))
             dma_trigger();
         return;
@@ -268,7 +301,7 @@ void VDP::control_port_w(uint16_t value)
     address_reg &= ~0x3FFF;
     address_reg |= value & 0x3FFF;
     command_word_pending = true;
-    fprintf(stdout, "[VDP][PC=%06x](%04d) command word 1st: code:%02x addr:%04x\n", m68k_get_reg(NULL, M68K_REG_PC), framecounter, code_reg, address_reg);
+    TRACE(TRACE_VDP, "command word 1st: code:%02x addr:%04x\n", code_reg, address_reg);
 }
 
 uint16_t VDP::status_register_r(void)
@@ -321,6 +354,35 @@ uint16_t VDP::status_register_r(void)
     return status;
 }
 
+// Master clock up to which status_register_r() keeps returning the same
+// value: the next HBLANK transition, or the end of the line (see hcounter()
+// for the position of HBLANK within the line).
+uint64_t VDP::status_stable_until(void)
+{
+    int mclk = MAX((int64_t)(sched_clock() - _line_clock), 0);
+    int pixels = REG12_MODE_H40 ? 420 : 342;
+    int edges[2];
+
+    if (REG12_MODE_H40)
+    {
+        edges[0] = 0x166 - 0xD;
+        edges[1] = 0x1AE - 0xD;
+    }
+    else
+    {
+        edges[0] = 0x126 - 0xB;
+        edges[1] = 0x15F - 0xB;
+    }
+
+    for (int i=0;i<2;++i)
+    {
+        int edge = (edges[i] * VDP_CYCLES_PER_LINE + pixels - 1) / pixels;
+        if (edge > mclk)
+            return _line_clock + edge;
+    }
+    return _line_clock + VDP_CYCLES_PER_LINE;
+}
+
 uint16_t VDP::hvcounter_r16(void)
 {
     if (hvcounter_latched)
@@ -334,19 +396,19 @@ uint16_t VDP::hvcounter_r16(void)
     return ((vc & 0xFF) << 8) | (hc >> 1);
 }
 
-void VDP::scanline(uint8_t* screen)
+void VDP::scanline()
 {
     mode_h40 = REG12_MODE_H40;
     mode_pal = REG1_PAL;
 
-    mem_log("VDP", "render scanline %d\n", _vcounter);
-    gfx_render_scanline(screen, _vcounter);
+    TRACE(TRACE_VDP, "render scanline %d\n", _vcounter);
+    gfx_render_scanline(_screen ? _screen + _vcounter*_pitch : NULL, _vcounter);
 
     // On these lines, the line counter interrupt is reloaded
     if (_vcounter == 0 || _vcounter >= (mode_pal ? 0xF1 : 0xE1))
     {
         if (REG0_LINE_INTERRUPT)
-            mem_log("VDP", "HINTERRUPT counter reloaded: (vcounter: %d, new counter: %d)\n", _vcounter, REG10_LINE_COUNTER);
+            TRACE(TRACE_VDP, "HINTERRUPT counter reloaded: (vcounter: %d, new counter: %d)\n", _vcounter, REG10_LINE_COUNTER);
         line_counter_interrupt = REG10_LINE_COUNTER;
     }
 
@@ -354,7 +416,7 @@ void VDP::scanline(uint8_t* screen)
     {
         if (REG0_LINE_INTERRUPT && (_vcounter <= (mode_pal ? 0xF0 : 0xE0)))
         {
-            mem_log("VDP", "HINTERRUPT (_vcounter: %d, new counter: %d)\n", _vcounter, REG10_LINE_COUNTER);
+            TRACE(TRACE_VDP, "HINTERRUPT (_vcounter: %d, new counter: %d)\n", _vcounter, REG10_LINE_COUNTER);
             hint_pending = true;
             if (!(status_reg & STATUS_VIRQPENDING))
                 CPU_M68K.irq(4);
@@ -392,6 +454,60 @@ unsigned int VDP::num_scanlines(void)
     return VERSION_PAL ? 313 : 262;
 }
 
+void VDP::set_framebuffer(uint8_t *screen, int pitch)
+{
+    _screen = screen;
+    _pitch = pitch;
+}
+
+// Process all the scanlines that ended before the specified clock
+void VDP::sync(uint64_t clock)
+{
+    if (clock < _line_clock + VDP_CYCLES_PER_LINE)
+        return;
+
+    PROF_BEGIN(PROF_VDP);
+    do {
+        scanline();
+        _line_clock += VDP_CYCLES_PER_LINE;
+    } while (clock >= _line_clock + VDP_CYCLES_PER_LINE);
+    PROF_END();
+}
+
+// Return the master clock of the next line boundary at which scanline()
+// might raise or lower an interrupt line (HINT, VINT, Z80 IRQ). This
+// simulates the line counter forward with the current register values,
+// so it must be recomputed whenever those registers change.
+uint64_t VDP::next_event(void)
+{
+    int pal = REG1_PAL;
+    int nlines = num_scanlines();
+    int vc = _vcounter;
+    int counter = line_counter_interrupt;
+    uint64_t clock = _line_clock;
+
+    for (int i = 0; i < nlines; ++i)
+    {
+        clock += VDP_CYCLES_PER_LINE;
+
+        if (vc == 0 || vc >= (pal ? 0xF1 : 0xE1))
+            counter = REG10_LINE_COUNTER;
+        if (--counter < 0)
+        {
+            if (REG0_LINE_INTERRUPT && vc <= (pal ? 0xF0 : 0xE0))
+                return clock;
+            counter = REG10_LINE_COUNTER;
+        }
+
+        if (++vc == nlines)
+            vc = 0;
+        if (vc == (pal ? 0xF0 : 0xE0) || vc == (pal ? 0xF1 : 0xE1))
+            return clock;
+    }
+
+    return clock;
+}
+
 
 
 /**************************************************************
@@ -434,7 +550,7 @@ void VDP::dma_fill(uint16_t value)
     if (length == 0)
         length = 0xFFFF;
 
-    mem_log("VDP", "(V=%x,H=%x) DMA %s fill: dst:%04x, length:%d, increment:%d, value=%02x\n",
+    TRACE(TRACE_DMA, "(V=%x,H=%x) DMA %s fill: dst:%04x, length:%d, increment:%d, value=%02x\n",
         vcounter(), hcounter(),
         (code_reg&0xF)==1 ? "VRAM" : ( (code_reg&0xF)==3 ? "CRAM" : "VSRAM"),
         address_reg, length, REG15_DMA_INCREMENT, value>>8);
@@ -442,6 +558,13 @@ void VDP::dma_fill(uint16_t value)
     switch (code_reg & 0xF)
     {
     case 0x1:
+        if ((REG15_DMA_INCREMENT == 1 || REG15_DMA_INCREMENT == 2) &&
+            address_reg + (length-1) * REG15_DMA_INCREMENT <= 0xFFFF)
+        {
+            dma_fill_vram(value >> 8, length);
+            src_addr_low += length;
+            break;
+        }
         do {
             VRAM_W((address_reg ^ 1) & 0xFFFF, value >> 8);
             address_reg += REG15_DMA_INCREMENT;
@@ -454,6 +577,7 @@ void VDP::dma_fill(uint16_t value)
             address_reg += REG15_DMA_INCREMENT;
             src_addr_low++;
         } while (--length);
+        GFX_DIRTY_CRAM = true;
         break;
     case 0x5:  // undocumented and buggy, see vdpfifotesting:
         do {
@@ -463,7 +587,7 @@ void VDP::dma_fill(uint16_t value)
         } while (--length);
         break;
     default:
-        mem_log("VDP", "invalid code_reg:%x during DMA fill\n", code_reg);
+        TRACE(TRACE_DMA, "invalid code_reg:%x during DMA fill\n", code_reg);
     }
 
     // Clear DMA length at the end of transfer
@@ -474,6 +598,99 @@ void VDP::dma_fill(uint16_t value)
     regs[22] = src_addr_low >> 8;
 }
 
+// Fill with increment 1 or 2, without wrapping around the end of VRAM
+void VDP::dma_fill_vram(uint8_t value, int length)
+{
+    if (REG15_DMA_INCREMENT == 2)
+    {
+        uint16_t start = address_reg ^ 1;
+        int end = start + (length-1)*2 + 1;     // can be the last byte of VRAM
+        for (int i=0;i<length;++i)
+            VRAM[start + i*2] = value;
+        gfx_vram_written(start, end);
+        sat_cache_update(start, end, 2);
+        address_reg += length*2;
+        return;
+    }
+
+    // Bytes are written swapped within each word, so only whole words
+    // can be filled in a block: the unaligned first/last byte goes
+    // through VRAM_W.
+    if (address_reg & 1)
+    {
+        VRAM_W(address_reg ^ 1, value);
+        address_reg++;
+        length--;
+    }
+
+    int n = length & ~1;
+    memset(VRAM + address_reg, value, n);
+    gfx_vram_written(address_reg, address_reg + n);
+    sat_cache_update(address_reg, address_reg + n, 1);
+    address_reg += n;
+
+    if (length & 1)
+    {
+        VRAM_W(address_reg ^ 1, value);
+        address_reg++;
+    }
+}
+
+// Transfer a run of words from a ROM/RAM page without going through the
+// memory handlers. Returns the number of words transferred, which is 0 if
+// the source isn't plain memory (or the destination needs the slow path).
+int VDP::dma_m68k_block(uint32_t src, int length)
+{
+    uint32_t addr = src << 1;
+    const uint8_t *mem = m68k_rtable[(addr >> 16) & 0xFF].mem;
+    if (!mem)
+        return 0;
+    mem += addr & 0xFFFF;
+
+    // Stop where the source address wraps (128KB) or the page ends
+    int n = MIN(length, 0x10000 - (int)(src & 0xFFFF));
+    n = MIN(n, (0x10000 - (int)(addr & 0xFFFF)) >> 1);
+
+    switch (code_reg & 0xF)
+    {
+    case 0x1:
+    {
+        if (REG15_DMA_INCREMENT != 2 || (address_reg & 1))
+            return 0;
+
+        // VRAM is big-endian like the 68000 memory, so it's a plain copy
+        n = MIN(n, (0x10000 - address_reg) >> 1);
+        memcpy(VRAM + address_reg, mem, n*2);
+        gfx_vram_written(address_reg, address_reg + n*2);
+        sat_cache_update(address_reg, address_reg + n*2, 1);
+        address_reg += n*2;
+        break;
+    }
+    case 0x3:
+        for (int i=0;i<n;++i)
+        {
+            CRAM[(address_reg >> 1) & 0x3F] = FETCH16(mem + i*2);
+            address_reg += REG15_DMA_INCREMENT;
+        }
+        GFX_DIRTY_CRAM = true;
+        break;
+    case 0x5:
+        for (int i=0;i<n;++i)
+        {
+            VSRAM[(address_reg >> 1) & 0x3F] = FETCH16(mem + i*2);
+            address_reg += REG15_DMA_INCREMENT;
+        }
+        break;
+    default:
+        return 0;
+    }
+
+    // The FIFO is left with the last words of the run
+    for (int i=MAX(n-4, 0);i<n;++i)
+        push_fifo(FETCH16(mem + i*2));
+    return n;
+}
+
 void VDP::dma_m68k()
 {
     int length = REG19_DMA_LENGTH;
@@ -484,12 +701,21 @@ void VDP::dma_m68k()
     if (length == 0)
         length = 0xFFFF;
 
-    mem_log("VDP", "(V=%x,H=%x) DMA M68k->%s copy: src:%04x, dst:%04x, length:%d, increment:%d\n",
+    TRACE(TRACE_DMA, "(V=%x,H=%x) DMA M68k->%s copy: src:%04x, dst:%04x, length:%d, increment:%d\n",
         vcounter(), hcounter(),
         (code_reg&0xF)==1 ? "VRAM" : ( (code_reg&0xF)==3 ? "CRAM" : "VSRAM"),
         (src_addr_high | src_addr_low) << 1, address_reg, length, REG15_DMA_INCREMENT);
 
-    do {
+    while (length > 0)
+    {
+        int n = dma_m68k_block(src_addr_high | src_addr_low, length);
+        if (n > 0)
+        {
+            src_addr_low += n;
+            length -= n;
+            continue;
+        }
+
         unsigned int value = m68k_read_memory_16((src_addr_high | src_addr_low) << 1);
         push_fifo(value);
 
@@ -500,19 +726,20 @@ void VDP::dma_m68k()
                 break;
             case 0x3:
                 CRAM[(address_reg >> 1) & 0x3F] = value;
+                GFX_DIRTY_CRAM = true;
                 break;
             case 0x5:
                 VSRAM[(address_reg >> 1) & 0x3F] = value;
                 break;
             default:
-                mem_log("VDP", "invalid code_reg:%x during DMA fill\n", code_reg);
+                TRACE(TRACE_DMA, "invalid code_reg:%x during DMA fill\n", code_reg);
                 break;
         }
 
         address_reg += REG15_DMA_INCREMENT;
         src_addr_low += 1;
-
-    } while (--length);
+        --length;
+    }
 
     // Update DMA source address after end of transfer
     regs[21] = src_addr_low & 0xFF;
@@ -522,21 +749,64 @@ void VDP::dma_m68k()
     regs[19] = regs[20] = 0;
 }
 
+// Copy with increment 1 between addresses of the same parity, without
+// wrapping around the end of VRAM. The transfer goes forward one byte
+// at a time, so when the destination is just after the source it
+// repeats the first (dst - src) bytes: the block moves must not be
+// longer than that.
+void VDP::dma_copy_vram(uint16_t src, int length)
+{
+    if (src & 1)
+    {
+        VRAM_W(address_reg ^ 1, VRAM[src ^ 1]);
+        address_reg++;
+        src++;
+        length--;
+    }
+
+    int n = length & ~1;
+    int dist = address_reg - src;
+    if (dist <= 0 || dist >= n)
+        memmove(VRAM + address_reg, VRAM + src, n);
+    else
+        for (int i=0;i<n;i+=dist)
+            memcpy(VRAM + address_reg + i, VRAM + src + i, MIN(dist, n-i));
+    gfx_vram_written(address_reg, address_reg + n);
+    sat_cache_update(address_reg, address_reg + n, 1);
+    address_reg += n;
+    src += n;
+
+    if (length & 1)
+    {
+        VRAM_W(address_reg ^ 1, VRAM[src ^ 1]);
+        address_reg++;
+    }
+}
+
 void VDP::dma_copy()
 {
     int length = REG19_DMA_LENGTH;
     uint16_t src_addr_low = REG21_DMA_SRCADDR_LOW;
 
     assert(length != 0);
-    mem_log("VDP", "DMA copy: src:%04x dst:%04x len:%x\n", src_addr_low, address_reg&0xFFFF, length);
+    TRACE(TRACE_DMA, "DMA copy: src:%04x dst:%04x len:%x\n", src_addr_low, address_reg&0xFFFF, length);
 
-    do {
-        uint16_t value = VRAM[src_addr_low ^ 1];
-        VRAM_W((address_reg ^ 1) & 0xFFFF, value);
+    if (REG15_DMA_INCREMENT == 1 && !((address_reg ^ src_addr_low) & 1) &&
+        address_reg + length <= 0x10000 && src_addr_low + length <= 0x10000)
+    {
+        dma_copy_vram(src_addr_low, length);
+        src_addr_low += length;
+    }
+    else
+    {
+        do {
+            uint16_t value = VRAM[src_addr_low ^ 1];
+            VRAM_W((address_reg ^ 1) & 0xFFFF, value);
 
-        address_reg += REG15_DMA_INCREMENT;
-        src_addr_low++;
-    } while (--length);
+            address_reg += REG15_DMA_INCREMENT;
+            src_addr_low++;
+        } while (--length);
+    }
 
     // Update DMA source address after end of transfer
     regs[21] = src_addr_low & 0xFF;
@@ -556,6 +826,29 @@ int m68k_int_ack(int irq)
     return VDP.irq_acked(irq);
 }
 
+bool VDP::alloc()
+{
+    VRAM = (uint8_t*)calloc(1, VRAM_SIZE);
+    return VRAM != NULL;
+}
+
+void VDP::release()
+{
+    free(VRAM);
+    VRAM = NULL;
+}
+
+// Power-on: clear memories and registers, then reset
+void VDP::init()
+{
+    uint8_t *vram = VRAM;
+    memset(this, 0, sizeof(*this));
+    VRAM = vram;
+    memset(VRAM, 0, VRAM_SIZE);
+    gfx_invalidate();
+    reset();
+}
+
 void VDP::reset()
 {
     command_word_pending = false;
@@ -565,6 +858,7 @@ void VDP::reset()
     status_reg = 0x3C00;
     line_counter_interrupt = 0;
     hvcounter_latched = false;
+    _line_clock = MASTER_CLOCK;
     m68k_set_int_ack_callback(m68k_int_ack);
 }
 
@@ -575,7 +869,7 @@ void vdp_mem_w8(unsigned int address, unsigned int value)
         case 0x13:
         case 0x15:
         case 0x17:
-            mem_log("SN76489", "write: %02x\n", value);
+            TRACE(TRACE_PSG, "write: %02x\n", value);
             return;
 
         default:
@@ -587,6 +881,8 @@ void vdp_mem_w8(unsigned int address, unsigned int value)
 
 void vdp_mem_w16(unsigned int address, unsigned int value)
 {
+    VDP.sync(sched_clock());
+
     switch (address & 0x1F) {
         case 0x0:
         case 0x2: VDP.data_port_w16(value); return;
@@ -602,7 +898,7 @@ void vdp_mem_w16(unsigned int address, unsigned int value)
             return;
 
         default:
-            fprintf(stdout, "[VDP][PC=%06x](%04d) unhandled write16 IO:%02x val:%04x\n", m68k_get_reg(NULL, M68K_REG_PC), framecounter, address&0x1F, value);
+            mem_err("VDP", "unhandled write16 IO:%02x val:%04x\n", address&0x1F, value);
             assert(!"unhandled vdp_mem_w16");
     }
 
@@ -620,12 +916,16 @@ unsigned int vdp_mem_r16(unsigned int address)
 {
     unsigned int ret;
 
+    VDP.sync(sched_clock());
+
     switch (address & 0x1F) {
         case 0x0:
         case 0x2: return VDP.data_port_r16();
 
         case 0x4:
-        case 0x6: return VDP.status_register_r();
+        case 0x6:
+            mem_idle_stable_until(VDP.status_stable_until());
+            return VDP.status_register_r();
 
         case 0x8:
         case 0xA:
@@ -639,7 +939,7 @@ unsigned int vdp_mem_r16(unsigned int address)
         case 0x1C: return 0xFFFF;
 
         default:
-            fprintf(stdout, "[VDP][PC=%06x](%04d) unhandled read16 IO:%02x\n", m68k_get_reg(NULL, M68K_REG_PC), framecounter, address&0x1F);
+            mem_err("VDP", "unhandled read16 IO:%02x\n", address&0x1F);
             assert(!"unhandled vdp_mem_r16");
             return 0xFF;
     }
@@ -660,11 +960,6 @@ int VDP::irq_acked(int irq)
     assert(0);
 }
 
-void vdp_scanline(uint8_t *screen)
-{
-    VDP.scanline(screen);
-}
-
 void vdp_init(void)
 {
     VDP.reset();
@@ -1,5 +1,6 @@
 
 #include <stdint.h>
+#include "machine.h"
 
 #if 0
 #define VDP_MASTER_FREQ       53693175   // NTSC
@@ -9,6 +10,8 @@
 #define VDP_CYCLES_PER_LINE   3420
 #define YM2612_FREQ           53267
 
+#define VRAM_SIZE             0x10000
+
 #define M68K_FREQ_DIVISOR     7
 #define Z80_FREQ_DIVISOR      14
 
@@ -17,9 +20,11 @@ class VDP
     friend class GFX;
     friend bool loadstate(const char *fn);
     friend void savestate(const char *fn);
+    friend void state_save_to(uint8_t *buf);
+    friend bool state_load_from(const uint8_t *buf);
 
 private:
-    uint8_t VRAM[0x10000];
+    uint8_t *VRAM;         // VRAM_SIZE bytes on the heap, see alloc()
     uint16_t CRAM[0x40];
     uint16_t VSRAM[0x40];  // only 40 words are really used
     uint8_t SAT_CACHE[0x400]; // internal copy of SAT
@@ -40,7 +45,12 @@ private:
     int mode_h40;
     int mode_pal;
 
+    uint64_t _line_clock;   // master clock at the start of the current line
+    uint8_t *_screen;
+    int _pitch;
+
     void VRAM_W(uint16_t address, uint8_t value);
+    void sat_cache_update(int start, int end, int step);
 
 private:
     void register_w(int reg, uint8_t value);
@@ -50,20 +60,35 @@ private:
     void dma_trigger();
     void dma_fill(uint16_t value);
     void dma_copy();
+    void dma_fill_vram(uint8_t value, int length);
+    void dma_copy_vram(uint16_t src, int length);
     void dma_m68k();
+    int dma_m68k_block(uint32_t src, int length);
     void push_fifo(uint16_t value);
 
     int get_nametable_A();
     int get_nametable_B();
     int get_nametable_W();
 
+    void scanline();
+
 public:
-    void scanline(uint8_t *screen);
+    // VRAM is allocated for each machine, not in thread-local storage.
+    // alloc() returns false if it's out of memory.
+    bool alloc();
+    void release();
+
+    void init();
     void reset();
     unsigned int num_scanlines();
 
+    void set_framebuffer(uint8_t *screen, int pitch);
+    void sync(uint64_t clock);
+    uint64_t next_event();
+
 public:
     uint16_t status_register_r();
+    uint64_t status_stable_until();
     void control_port_w(uint16_t value);
     void data_port_w16(uint16_t value);
     uint16_t data_port_r16(void);
@@ -72,10 +97,9 @@ public:
     int irq_acked(int level);
 };
 
-extern class VDP VDP;
+extern MACHINE_LOCAL class VDP VDP;
 
 void vdp_init(void);
-void vdp_scanline(uint8_t *screen);
 
 void vdp_mem_w8(unsigned int address, unsigned int value);
 void vdp_mem_w16(unsigned int address, unsigned int value);
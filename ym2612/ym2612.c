@@ -131,6 +131,7 @@
 #include <stdint.h>
 #include <memory.h>
 #include <math.h>
+#include "../machine.h"
 typedef uint32_t UINT32;
 typedef uint16_t UINT16;
 typedef uint8_t UINT8;
@@ -618,16 +619,16 @@ typedef struct
 } YM2612;
 
 /* emulated chip */
-static YM2612 ym2612;
+static MACHINE_LOCAL YM2612 ym2612;
 
 /* current chip state */
-static INT32  m2,c1,c2;   /* Phase Modulation input for operators 2,3,4 */
-static INT32  mem;        /* one sample delay memory */
-static INT32  out_fm[8];  /* outputs of working channels */
-static UINT32 bitmask;    /* working channels output bitmasking (DAC quantization) */
+static MACHINE_LOCAL INT32  m2,c1,c2;   /* Phase Modulation input for operators 2,3,4 */
+static MACHINE_LOCAL INT32  mem;        /* one sample delay memory */
+static MACHINE_LOCAL INT32  out_fm[8];  /* outputs of working channels */
+static MACHINE_LOCAL UINT32 bitmask;    /* working channels output bitmasking (DAC quantization) */
 
 /* mirror of all OPN registers */
-static uint8_t OPNREGS[512];
+static MACHINE_LOCAL uint8_t OPNREGS[512];
 
 INLINE void FM_KEYON(FM_CH *CH , int s )
 {
@@ -1900,8 +1901,18 @@ static void init_tables(void)
 /* initialize ym2612 emulator */
 void YM2612Init(void)
 {
+  static int tables_initialized = 0;
+
   memset(&ym2612,0,sizeof(YM2612));
-  init_tables();
+  memset(OPNREGS,0,sizeof(OPNREGS));
+  mem = 0;
+
+  /* tables are shared by all the instances */
+  if (!tables_initialized)
+  {
+    init_tables();
+    tables_initialized = 1;
+  }
 }
 
 /* reset OPN registers */
@@ -2166,8 +2177,21 @@ void YM2612LoadRegs(uint8_t *regs)
 }
 
 
-#if 0
-int YM2612LoadContext(unsigned char *state)
+/* context (savestate) serialization */
+#define load_param(param, size) \
+  memcpy(param, &state[bufferptr], size); \
+  bufferptr += size;
+
+#define save_param(param, size) \
+  memcpy(&state[bufferptr], param, size); \
+  bufferptr += size;
+
+int YM2612GetContextSize(void)
+{
+  return sizeof(ym2612) + sizeof(OPNREGS) + 6*4;
+}
+
+int YM2612LoadContext(const unsigned char *state)
 {
   int c,s;
   uint8 index;
@@ -2175,6 +2199,7 @@ int YM2612LoadContext(unsigned char *state)
 
   /* restore YM2612 context */
   load_param(&ym2612, sizeof(ym2612));
+  load_param(OPNREGS, sizeof(OPNREGS));
 
   /* restore DT table address pointer for each channel slots */
   for (c=0; c<6; c++)
@@ -2182,7 +2207,6 @@ int YM2612LoadContext(unsigned char *state)
     for (s=0; s<4; s++)
     {
       load_param(&index,sizeof(index));
-      bufferptr += sizeof(index);
       ym2612.CH[c].SLOT[s].DT = ym2612.OPN.ST.dt_tab[index&7];
     }
   }
@@ -2207,6 +2231,7 @@ int YM2612SaveContext(unsigned char *state)
 
   /* save YM2612 context */
   save_param(&ym2612, sizeof(ym2612));
+  save_param(OPNREGS, sizeof(OPNREGS));
 
   /* save DT table index for each channel slots */
   for (c=0; c<6; c++)
@@ -2215,10 +2240,8 @@ int YM2612SaveContext(unsigned char *state)
     {
       index = (ym2612.CH[c].SLOT[s].DT - ym2612.OPN.ST.dt_tab[0]) >> 5;
       save_param(&index,sizeof(index));
-      bufferptr += sizeof(index);
     }
   }
 
   return bufferptr;
 }
-#endif